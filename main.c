@@ -5,8 +5,17 @@
 #endif
 #include <stdio.h>    // printf
 #include <stdlib.h>   // calloc
+#include <string.h>   // strlen, strcmp
 
 #include "xml.h"
+#ifndef WIN32
+#include "xml_io.h"
+#include <fcntl.h>      // open
+#include <unistd.h>     // close
+#include <sys/mman.h>   // mmap
+#include <sys/stat.h>   // fstat
+#include <time.h>       // clock_gettime
+#endif
 
 void my_xml_foreach_func( XmlElement* _elem, void* _param )
 {
@@ -60,6 +69,35 @@ static void do_xml_tests( XmlElement* root )
     {
       printf("%ld: %s=\"%s\"\n",i,elements[i]->name,(elements[i]->content!=0) ? elements[i]->content : "(null)");
     }
+    free(elements);
+  }
+
+  // the same in one pass: the matches go to a growable buffer. the thread's
+  // scratch results are reused by every query, no allocation once it is big enough
+  {
+    XmlResults* results = xml_results_scratch();
+    xml_element_collect_elements(root, "bar", results);
+    printf("collected %lu elements\n",(unsigned long)results->count);
+  }
+
+  // or lazily, stopping at the first <bar> without content
+  {
+    XmlCursor cursor;
+    XmlElement* bar;
+    xml_cursor_init(&cursor, root, "bar");
+    while ((bar = xml_cursor_next(&cursor)) != 0 && bar->content != 0);
+  }
+
+  // columnar export: one pass over all <bar> records, Arrow-compatible buffers
+  {
+    XmlColumn columns[2] = {{0}};
+    columns[0].attribute = "id";
+    columns[0].type = XML_COLUMN_INT64;
+    columns[1].element = "name";
+    columns[1].type = XML_COLUMN_STRING;
+    xml_element_extract_columns(root, "bar", columns, 2);
+    printf("extracted %lu rows\n",(unsigned long)columns[0].length);
+    xml_columns_free(columns, 2);
   }
 
   if (true == xml_element_name(e, "foo"))
@@ -79,6 +117,24 @@ static void do_xml_tests( XmlElement* root )
     size_t n_chars = xml_element_get_content(e, 0, 0);
     char* content = (char*) calloc(1,n_chars+1);  // + \0 byte
     xml_element_get_content(e,content,n_chars);
+    free(content);
+
+    // or without a copy: the text nodes as a list of spans
+    XmlSpan spans[16];
+    size_t n_spans = xml_element_get_spans(e, spans, 16, 0);
+    for (size_t i=0; i<n_spans && i<16; ++i)
+    {
+      printf("%.*s",(int)spans[i].size,spans[i].data);
+    }
+    printf("\n");
+  }
+
+  // namespace-aware matching: look the URI up once, then compare (nsId, localName).
+  // the prefix in the document does not matter
+  {
+    unsigned int svg = xml_namespace_id(root, "http://www.w3.org/2000/svg");
+    e = xml_element_find_any_ns(root, svg, "path");
+    a = xml_element_find_attribute_ns(e, xml_namespace_id(root, "http://www.w3.org/1999/xlink"), "href", 0);
   }
 
   // get element content
@@ -117,22 +173,14 @@ void xml_error_handler( const char* _errorMessage, const char* _begin, const cha
   fprintf(stderr,"ERROR: %s\n",_errorMessage);
 }
 
-void process_file( const char* filename )
+static bool has_suffix( const char* _str, const char* _suffix )
 {
-  // load a file to memory, do whatever you want here
-  char* mem = 0;
-  size_t size = 0;
+  size_t n = strlen(_str), m = strlen(_suffix);
+  return n>=m && 0==strcmp(_str+n-m,_suffix);
+}
 
-  FILE* file = fopen(filename,"rb");
-  if (file)
-  {
-    fseek(file,0,SEEK_END);
-    size = ftell(file);
-    fseek(file,0,SEEK_SET);
-    mem = (char*) malloc(size);
-    fread(mem,size,1,file);
-    fclose(file);
-  }
+void process_buffer( const char* filename, char* mem, size_t size )
+{
   /*
   XmlSizeofHint hints[] = {
   { "foo:bar", 0, 101 },
@@ -147,21 +195,355 @@ void process_file( const char* filename )
   {
     printf("passed : %s\n",filename);
     do_xml_tests(root);
+    size_t n_nodes = xml_element_find_elements(root,0,0,0);
     free(root);
+
+    // parse flags: with XML_PARSE_SKIP_WHITESPACE the indentation of
+    // pretty-printed input is not content, the whitespace-only text nodes are dropped
+    XmlOptions options = {0};
+    options.flags = XML_PARSE_SKIP_WHITESPACE;
+    root = xml_create_ex(mem,mem+size,xml_error_handler,malloc,0,&options);
+    if (root)
+    {
+      printf("skip whitespace : %lu of %lu nodes\n",(unsigned long)xml_element_find_elements(root,0,0,0),(unsigned long)n_nodes);
+      free(root);
+    }
   }
   else
   {
     printf("failed : %s\n",filename);
   }
+}
+
+// text options: with XML_PARSE_COALESCE_TEXT the entity, the CDATA section
+// and the text around the comment end up in one text node
+void coalesce_text_demo( void )
+{
+  const char* text = "<a:x>hello &amp; <![CDATA[<cd>]]> world<!-- c -->tail</a:x>";
+  XmlOptions options = {0};
+  options.flags = XML_PARSE_COALESCE_TEXT;
+  XmlElement* root = xml_create_ex(text,text+strlen(text),xml_error_handler,malloc,0,&options);
+  if (root)
+  {
+    printf("coalesced: \"%s\"\n",root->elements->content);   // "hello & <cd> worldtail"
+    free(root);
+  }
+}
+
+// diff of a list of same-named rows: one inserted or removed row is one
+// difference, the rows after it are not reported as changed
+void diff_demo( void )
+{
+  const char* documents[] = {
+    "<list><row>1</row><row>2</row><row>3</row><row>4</row><row>5</row></list>",
+    "<list><row>0</row><row>1</row><row>2</row><row>3</row><row>4</row><row>5</row></list>",
+    "<list><row>1</row><row>2</row><row>4</row><row>5</row></list>",
+    0
+  };
+  XmlElement* old = xml_create(documents[0],documents[0]+strlen(documents[0]),xml_error_handler,malloc,0);
+  for (const char** iter = documents+1; old && *iter; ++iter)
+  {
+    XmlElement* root = xml_create(*iter,*iter+strlen(*iter),xml_error_handler,malloc,0);
+    if (root)
+    {
+      printf("diff : %lu\n",(unsigned long)xml_document_diff(old,root,0,0));   // 1, 1
+      free(root);
+    }
+  }
+  free(old);
+}
+
+// gateway check: "xml -validate <file>...", no tree is built
+void validate_file( const char* filename )
+{
+  char* mem = 0;
+  size_t size = 0;
+
+  FILE* file = fopen(filename,"rb");
+  if (file)
+  {
+    fseek(file,0,SEEK_END);
+    size = ftell(file);
+    fseek(file,0,SEEK_SET);
+    mem = (char*) malloc(size);
+    fread(mem,size,1,file);
+    fclose(file);
+  }
+  XmlValidationError error;
+  if (mem && xml_validate(mem,mem+size,&error))
+  {
+    printf("well-formed : %s\n",filename);
+  }
+  else if (mem)
+  {
+    printf("malformed : %s:%lu:%lu: %s\n",filename,(unsigned long)error.line,(unsigned long)error.column,error.message);
+  }
+  else
+  {
+    printf("failed : %s\n",filename);
+  }
+  if (mem) free(mem);
+}
+
+// "xml -validate" without files checks a few inline documents
+void validate_demo( void )
+{
+  const char* documents[] = {
+    "<a x='1' y='2'><b/></a>",
+    "<a x='1' x='2'/>",         // an attribute name may appear only once per tag
+    "<a><b></a></b>",
+    0
+  };
+  for (const char** iter = documents; *iter; ++iter)
+  {
+    XmlValidationError error;
+    if (xml_validate(*iter,*iter+strlen(*iter),&error)) printf("well-formed : %s\n",*iter);
+    else printf("malformed : %s :%lu: %s\n",*iter,(unsigned long)error.column,error.message);
+  }
+}
+
+#ifndef WIN32
+// consecutive plain files of the command line, read with several reads in
+// flight. the reads complete in any order, a file that is ahead of the
+// command line keeps its buffer until the files in front of it are done.
+typedef struct
+{
+  const char* const*  files;
+  size_t              count;
+  size_t              next;       // the first file that is not processed yet
+  bool*               done;       // read or failed
+  char**              data;       // the kept buffers, 0 if the file failed
+  size_t*             sizes;
+} IngestBatch;
+
+static size_t ingest_index( IngestBatch* batch, const char* filename )
+{
+  size_t i = batch->next;
+  while (batch->files[i]!=filename) i++;
+  return i;
+}
+
+static void ingest_flush( IngestBatch* batch )
+{
+  for (; batch->next<batch->count && batch->done[batch->next]; batch->next++)
+  {
+    size_t i = batch->next;
+    if (batch->data[i]) process_buffer(batch->files[i],batch->data[i],batch->sizes[i]);
+    else printf("failed : %s\n",batch->files[i]);
+    free(batch->data[i]);
+  }
+}
+
+static bool ingest_file( void* _param, const char* filename, char* mem, size_t size )
+{
+  IngestBatch* batch = (IngestBatch*) _param;
+  size_t i = ingest_index(batch,filename);
+  batch->done[i] = true;
+  if (i!=batch->next)
+  {
+    batch->data[i] = mem;
+    batch->sizes[i] = size;
+    return true;    // keep the buffer until it is the file's turn
+  }
+  process_buffer(filename,mem,size);
+  batch->next++;
+  ingest_flush(batch);
+  return false;   // the tree holds copies, the buffer can be reused
+}
+
+static void ingest_failed( void* _param, const char* filename, int error )
+{
+  IngestBatch* batch = (IngestBatch*) _param;
+  fprintf(stderr,"ERROR: %s\n",strerror(error));
+  if (filename==0) return;
+  batch->done[ingest_index(batch,filename)] = true;
+  ingest_flush(batch);
+}
 
+static void ingest_files( const char* const* files, size_t count )
+{
+  IngestBatch batch = {0};
+  batch.files = files;
+  batch.count = count;
+  batch.done = (bool*) calloc(count,sizeof(bool));
+  batch.data = (char**) calloc(count,sizeof(char*));
+  batch.sizes = (size_t*) calloc(count,sizeof(size_t));
+  if (batch.done && batch.data && batch.sizes)
+  {
+    // the callbacks run on this thread (no workers), so the batch needs no lock
+    xml_ingest_files(files,count,16,0,ingest_file,ingest_failed,&batch);
+    for (size_t i=batch.next; i<count; ++i) batch.done[i] = true;   // lost in the kernel
+    ingest_flush(&batch);
+  }
+  free(batch.sizes);
+  free(batch.data);
+  free(batch.done);
+}
+#endif
+
+void process_file( const char* filename )
+{
+#ifndef WIN32
+  // compressed archives are decompressed and parsed at the same time,
+  // the plain text is never in memory as a whole
+  if (has_suffix(filename,".gz") || has_suffix(filename,".zst"))
+  {
+    XmlStream* stream = xml_stream_create_document(xml_error_handler,0);
+    if (xml_stream_feed_file(stream,filename,XML_CODEC_AUTO) && xml_stream_finish(stream))
+    {
+      printf("passed : %s\n",filename);
+      do_xml_tests(xml_stream_document(stream));
+    }
+    else
+    {
+      printf("failed : %s\n",filename);
+    }
+    xml_stream_destroy(stream);
+    return;
+  }
+#endif
+
+  // load a file to memory, do whatever you want here
+  char* mem = 0;
+  size_t size = 0;
+
+  FILE* file = fopen(filename,"rb");
+  if (file)
+  {
+    fseek(file,0,SEEK_END);
+    size = ftell(file);
+    fseek(file,0,SEEK_SET);
+    mem = (char*) malloc(size);
+    fread(mem,size,1,file);
+    fclose(file);
+  }
+  process_buffer(filename,mem,size);
   if (mem) free(mem);
 }
 
+#ifndef WIN32
+// large document benchmark: "xml -bench <file|MB>...". files are mapped,
+// numbers synthesize a record document of that many megabytes in an anonymous
+// mapping. run it with sizes on both sides of 4 GB, the MB/s should not change.
+static double bench_now( void )
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// the scanner may look at the byte at the end of the document, so there is
+// always a zero page behind it
+static size_t bench_mapping( size_t size )
+{
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  return ((size + page-1) & ~(page-1)) + page;
+}
+
+static char* bench_generate( size_t size )
+{
+  char* mem = (char*) mmap(0,bench_mapping(size),PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+  if (mem==MAP_FAILED) return 0;
+  size_t pos = sprintf(mem,"<records>\n");
+  size_t id = 0;
+  while (pos + 128 < size)
+  {
+    pos += sprintf(mem+pos,"  <row id=\"%zu\" name=\"n%zu\"><x>%zu</x></row>\n",id,id*7,id*13);
+    id++;
+  }
+  pos += sprintf(mem+pos,"</records>\n");
+  memset(mem+pos,' ',size-pos);
+  return mem;
+}
+
+static void bench( const char* arg )
+{
+  size_t size = 0;
+  char* mem = 0;
+  int fd = open(arg,O_RDONLY);
+  if (fd>=0)
+  {
+    struct stat st;
+    fstat(fd,&st);
+    size = st.st_size;
+    // the file goes over the start of a zeroed mapping
+    mem = (char*) mmap(0,bench_mapping(size),PROT_READ,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if (mem!=MAP_FAILED && size && MAP_FAILED==mmap(mem,size,PROT_READ,MAP_PRIVATE|MAP_FIXED,fd,0))
+    {
+      munmap(mem,bench_mapping(size));
+      mem = (char*) MAP_FAILED;
+    }
+    close(fd);
+    if (mem==MAP_FAILED) mem = 0;
+    else madvise(mem,size,MADV_SEQUENTIAL);
+  }
+  else
+  {
+    size = (size_t) strtoull(arg,0,10) << 20;
+    if (size) mem = bench_generate(size);
+  }
+  if (mem==0)
+  {
+    printf("bench: cannot map %s\n",arg);
+    return;
+  }
+
+  // the tree goes to huge pages on this thread's NUMA node
+  XmlArena arena = xml_arena_pages(XML_ARENA_HUGEPAGES|XML_ARENA_NUMA_LOCAL);
+  XmlOptions options = {0};
+  options.flags = XML_PARSE_SKIP_WHITESPACE;
+  options.arena = &arena;
+  double t0 = bench_now();
+  XmlElement* root = xml_create_ex(mem,mem+size,xml_error_handler,0,0,&options);
+  double t1 = bench_now();
+  size_t n_elements = root ? xml_element_find_elements(root,0,0,0) : 0;
+  printf("bench: %s %.1f MB, %zu elements, %.2f s, %.1f MB/s\n",arg,size/1048576.0,n_elements,t1-t0,size/1048576.0/(t1-t0));
+  xml_destroy(root);
+  munmap(mem,bench_mapping(size));
+}
+#endif
+
 int main (int argc, const char * argv[])
 {
   const char* filename = "test.xml";
-  if (argc>1) filename = argv[1];
-  process_file(filename);
+  if (argc<2)
+  {
+    process_file(filename);
+    coalesce_text_demo();
+    diff_demo();
+    return 0;
+  }
+  if (0==strcmp(argv[1],"-validate"))
+  {
+    if (2==argc) validate_demo();
+    for (int i=2; i<argc; ++i) validate_file(argv[i]);
+    return 0;
+  }
+#ifndef WIN32
+  if (0==strcmp(argv[1],"-bench"))
+  {
+    for (int i=2; i<argc; ++i) bench(argv[i]);
+    return 0;
+  }
+#endif
+#ifndef WIN32
+  // the output follows the command line. a run of plain files goes through
+  // the asynchronous reader in one batch, a compressed file ends the batch.
+  for (int i=1; i<argc; )
+  {
+    if (has_suffix(argv[i],".gz") || has_suffix(argv[i],".zst"))
+    {
+      process_file(argv[i++]);
+      continue;
+    }
+    int n = 1;
+    while (i+n<argc && !has_suffix(argv[i+n],".gz") && !has_suffix(argv[i+n],".zst")) n++;
+    ingest_files(argv+i,n);
+    i += n;
+  }
+#else
+  for (int i=1; i<argc; ++i) process_file(argv[i]);
+#endif
 
   return 0;
 }
@@ -31,7 +31,9 @@
 #include "xml.h"
 #endif
 
-#include <string.h>		// strstr, strchr
+#include <string.h>		// strstr, strchr, memchr
+#include <stdlib.h>		// malloc, realloc, free
+#include <stddef.h>		// ptrdiff_t
 
 // internal data representation
 
@@ -39,6 +41,11 @@ typedef struct _XmlNamedElement XmlNamedElement;
 typedef struct _XmlNamedAttribute XmlNamedAttribute;
 typedef struct _XmlScannerContext XmlScannerContext;
 typedef struct _XmlContext XmlContext;
+typedef struct _XmlDocument XmlDocument;
+typedef struct _XmlNamespaceBinding XmlNamespaceBinding;
+typedef struct _XmlQueryCache XmlQueryCache;
+typedef struct _XmlQueryEntry XmlQueryEntry;
+typedef struct _XmlSourceRange XmlSourceRange;
 
 struct _XmlNamedElement
 {
@@ -56,56 +63,213 @@ struct _XmlContext
 {
 };
 
+// follows the XmlElement struct if the document has XML_PARSE_SOURCE_RANGES.
+// the element children of an element are indexed in document order, the
+// array is followed by a Fenwick tree of the length changes of each child,
+// so the position of a child is its offset plus the changes in front of it.
+struct _XmlSourceRange
+{
+  size_t              offset;     // from the start of the parent, as parsed
+  size_t              length;
+  size_t              count;      // element children
+  XmlElement**        children;   // 0 if there are none, then ptrdiff_t shifts[count]
+};
+
+// every document starts with this header, the root element comes first so
+// that the root pointer is also the pointer to the memory block.
+struct _XmlDocument
+{
+  XmlElement          root;
+  XmlArena            arena;      // arena.free==0: the block is not ours to release
+  size_t              size;       // bytes allocated for the whole block
+  const char**        namespaces; // interned namespace URIs, nsId-1 is the index
+  size_t              nNamespaces;
+  bool                frozen;     // immutable, see xml_document_freeze
+  long                refs;       // references besides the first one
+  XmlQueryCache*      cache;      // query results of the frozen document
+  unsigned int        flags;      // XML_PARSE_* of xml_create_ex
+  XmlDocument*        fragments;  // subtrees of xml_reparse_range, freed with the document
+  XmlSourceRange      source;     // of the root, XML_PARSE_SOURCE_RANGES only
+};
+
+// xmlns declaration in scope while the tree is built
+struct _XmlNamespaceBinding
+{
+  const char*         prefix;     // "" for the default namespace
+  size_t              size;
+  unsigned int        nsId;       // 0 if the declaration undeclares the default namespace
+  XmlElement*         owner;      // the binding goes out of scope with this element
+};
+
 struct _XmlScannerContext
 {
   XmlElement*         pRoot;
   XmlErrorHandler     errorHandler;
-  XmlSizeofHint*      sizeofHints;
+  const XmlHintTable* hints;
+  XmlForEachFunc      open;
+  XmlForEachFunc      close;
+  void*               param;
+  size_t              attributeHashWidth;
   const char*         begin;
   const char*         end;
-  unsigned int        nChars;		// byte-aligned
-  unsigned int        nBytes;		// struct-aligned
-  unsigned int        nUsedChars;
-  unsigned int        nUsedBytes;
+  unsigned int        flags;		// XML_PARSE_*
+  bool                zeroed;		// the block is zero-filled already
+  size_t              nChars;		// byte-aligned
+  size_t              nBytes;		// struct-aligned
+  size_t              nUsedChars;
+  size_t              nUsedBytes;
+  size_t              textSize;		// length of the current text run
+  size_t              nDeclarations;	// xmlns attributes
+  XmlNamespaceBinding* bindings;
+  size_t              nBindings;
+  const char*         parentStart;	// source position of the element that is scanned
+  // xml_reparse_range: the namespaces of the document and the scope of the new subtree
+  const char**        seedNamespaces;
+  size_t              nSeedNamespaces;
+  XmlElement*         scope;
+  size_t              nInherited;
 };
 
 // private methods.
 
 // alloc memory, if _string is true the string pool is used
-static void* xml_alloc_memory( XmlScannerContext* _ctx, const unsigned int _bytes, bool _string /*= false*/ );
+static void* xml_alloc_memory( XmlScannerContext* _ctx, const size_t _bytes, bool _string /*= false*/ );
 // duplicate string (automatically adds a null byte)
-static char* xml_clone_string( XmlScannerContext* _ctx, const char* _str, const unsigned int _size, const bool _escape /*= true*/ );
+static char* xml_clone_string( XmlScannerContext* _ctx, const char* _str, const size_t _size, const bool _escape /*= true*/ );
 // build the XML document tree in two passes (_scanonly = false,true)
 static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _element, const char* _begin, const char* _end, bool _scanonly );
+// both passes, returns the root of the new document
+static XmlElement* xml_document_create( XmlScannerContext* _ctx, XmlAllocator _allocate, const XmlArena* _arena );
 // link attribute to attributes list
 static void xml_element_add_attribute( XmlElement* _elem, XmlAttribute* _attr );
 // link element to elements list
 static void xml_element_add_element( XmlElement* _elem, XmlElement* _child );
+// index the _count element children of a complete element (XML_PARSE_SOURCE_RANGES)
+static void xml_source_index( XmlScannerContext* _ctx, XmlElement* _elem, size_t _count, bool _scanonly );
+
+// compiled size hints, open addressing with linear probing
+
+typedef struct _XmlHintSlot XmlHintSlot;
+
+struct _XmlHintSlot
+{
+  const char*         name;       // 0 if the slot is free
+  size_t              length;
+  size_t              hash;
+  size_t              size;       // pointer-aligned
+};
+
+struct _XmlHintTable
+{
+  size_t              mask;       // number of slots - 1
+  size_t              wildcard;   // size for elements without a hint
+  XmlHintSlot*        slots;
+};
+
+// FNV-1a, names are short
+static size_t xml_hint_hash( const char* _name, size_t _length )
+{
+  size_t h = (size_t) 14695981039346656037ULL;
+  for (size_t i=0; i<_length; ++i)
+  {
+    h ^= (unsigned char) _name[i];
+    h *= (size_t) 1099511628211ULL;
+  }
+  return h;
+}
 
-static bool xml_namespace_compare(const char* _name, const char* _value);
+static const XmlHintSlot* xml_hint_find( const XmlHintTable* _table, const char* _name, size_t _length, size_t _hash )
+{
+  size_t i = _hash & _table->mask;
+  while (_table->slots[i].name)
+  {
+    const XmlHintSlot* slot = _table->slots + i;
+    if (slot->hash==_hash && slot->length==_length && 0==memcmp(slot->name,_name,_length)) return slot;
+    i = (i+1) & _table->mask;
+  }
+  return 0;
+}
 
-static size_t xml_sizeof( XmlSizeofHint* _sizeofHints, const char* _element, size_t _elementSize, const char* _attribute, size_t _attributeSize )
+// reserved bytes for the element name [_name,_name+_length)
+static size_t xml_hint_size( const XmlHintTable* _table, const char* _name, size_t _length )
 {
-  XmlSizeofHint* iter = _sizeofHints;
-  while (iter && (iter->element || iter->attribute || iter->size)) // three zeros terminate the list
+  if (0==_table) return 0;
+  const XmlHintSlot* slot = xml_hint_find(_table,_name,_length,xml_hint_hash(_name,_length));
+  if (0==slot)
   {
-    if (iter->element==0 || xml_compare(_element,iter->element))
+    const char* colon = (const char*) memchr(_name,':',_length);
+    if (colon)
     {
-      return iter->size;
+      _length -= (colon+1)-_name;
+      _name = colon+1;
+      slot = xml_hint_find(_table,_name,_length,xml_hint_hash(_name,_length));
     }
-    iter++;
   }
-  // again, but with relaxed namespaces
-  iter = _sizeofHints;
-  while (iter && (iter->element || iter->attribute || iter->size)) // three zeros terminate the list
+  return slot ? slot->size : _table->wildcard;
+}
+
+XML_C_API XmlHintTable* xml_hint_table_create( const XmlSizeofHint* _sizeofHints )
+{
+  const XmlSizeofHint* iter;
+  size_t n = 0, chars = 0;
+  for (iter = _sizeofHints; iter && (iter->element || iter->attribute || iter->size); iter++)	// three zeros terminate the list
+  {
+    if (iter->element) { n++; chars += strlen(iter->element); }
+  }
+  size_t slots = 8;
+  while (slots < 2*n) slots *= 2;	// at most half full
+
+  // one block: table, slots and the names
+  XmlHintTable* table = (XmlHintTable*) calloc(1,sizeof(XmlHintTable) + slots*sizeof(XmlHintSlot) + chars);
+  if (0==table) return 0;
+  table->mask = slots-1;
+  table->slots = (XmlHintSlot*)(table+1);
+  char* names = (char*)(table->slots+slots);
+  bool wildcard = false;
+  for (iter = _sizeofHints; iter && (iter->element || iter->attribute || iter->size); iter++)
   {
-    if (iter->element==0 || xml_namespace_compare(_element,iter->element))
+    size_t size = (iter->size + sizeof(void*)-1) & ~(sizeof(void*)-1);
+    if (0==iter->element)
     {
-      return iter->size;
+      if (!wildcard) table->wildcard = size;
+      wildcard = true;
+      continue;
     }
-    iter++;
+    size_t length = strlen(iter->element);
+    size_t hash = xml_hint_hash(iter->element,length);
+    if (xml_hint_find(table,iter->element,length,hash)) continue;	// the first hint wins
+    size_t i = hash & table->mask;
+    while (table->slots[i].name) i = (i+1) & table->mask;
+    memcpy(names,iter->element,length);
+    table->slots[i].name = names;
+    table->slots[i].length = length;
+    table->slots[i].hash = hash;
+    table->slots[i].size = size;
+    names += length;
   }
-  return 0;
+  return table;
+}
+
+XML_C_API void xml_hint_table_destroy( XmlHintTable* _table )
+{
+  free(_table);
+}
+
+XML_C_API size_t xml_hint_table_lookup( const XmlHintTable* _table, const char* _name )
+{
+  return _name ? xml_hint_size(_table,_name,strlen(_name)) : 0;
+}
+
+static bool xml_is_space( const char _ch )
+{
+  return ' '==_ch || '\t'==_ch || '\n'==_ch || '\r'==_ch;
+}
+
+// true if [_begin,_end) contains nothing but whitespace
+static bool xml_is_blank( const char* _begin, const char* _end )
+{
+  while (_begin<_end && xml_is_space(*_begin)) _begin++;
+  return _begin==_end;
 }
 
 // scan for the next character not in [ \t\n\r]* in the range [_begin,_end]
@@ -122,16 +286,23 @@ static const char* scan_whitespace( const char* _begin, const char* _end )
 
 // scan for the first char not in [a-zA-Z0-9\.\:_\-\/]+ in the range [_begin,_end]
 // any prefixing whitespace is ignored.
-static const char* scan_identifier( const char* _begin, const char* _end )
+// *_colon (if not null) gets the first ':' of the identifier or null
+static const char* scan_identifier( const char* _begin, const char* _end, const char** _colon )
 {
   char ch;
+  if (_colon) *_colon = 0;
   _begin = scan_whitespace(_begin,_end);
   while( 0 !=(ch = *_begin++) )
   {
     if (_begin > _end) break;
     if ((ch>='a' && ch<='z') || (ch>='A' && ch<='Z')
-      || (ch>='0' && ch<='9') || (ch=='.')	|| (ch==':')
+      || (ch>='0' && ch<='9') || (ch=='.')
       || (ch=='_') || (ch=='-') || (ch=='/')) continue;
+    else if (ch==':')
+    {
+      if (_colon && 0==*_colon) *_colon = _begin-1;
+      continue;
+    }
     else break;
   }
   return _begin-1;
@@ -141,7 +312,7 @@ static const char* scan_identifier( const char* _begin, const char* _end )
 // different encodings and esXML_C_APIngs (i.e. quoted html entities and plain entities)
 XML_C_API bool xml_compare( const char* _str, const char* _text )
 {
-  int i=0;
+  size_t i=0;
   if (0==_str) return false;
   while (_text[i])
   {
@@ -151,38 +322,207 @@ XML_C_API bool xml_compare( const char* _str, const char* _text )
   return true;
 }
 
-static bool xml_namespace_compare(const char* _name, const char* _value)
+// "href" matches "href", "xlink:href" and "foo:href", but "xlink:href" only
+// matches "xlink:href".
+static bool xml_name_match( const char* _name, const char* _localName, const char* _value )
 {
-  const char* name = strchr(_name,':');
-  const char* value = strchr(_value,':');
-  if (name) name++; else name=_name;
-  if (value) value++; else value=_value;
-  return xml_compare(name,value);
+  if (strchr(_value,':')) return 0==strcmp(_name,_value);
+  return 0==strcmp(_localName ? _localName : _name,_value);
 }
 
 XML_C_API bool xml_element_name( XmlElement* _elem, const char* _value )
 {
-  return (_elem && _elem->name && xml_namespace_compare(_elem->name,_value));
+  return (_elem && _elem->name && xml_name_match(_elem->name,_elem->localName,_value));
 }
 
 XML_C_API bool xml_attribute_name( XmlAttribute* _attr, const char* _value )
 {
-  return (_attr && _attr->name && xml_namespace_compare(_attr->name,_value));
+  return (_attr && _attr->name && xml_name_match(_attr->name,_attr->localName,_value));
+}
+
+XML_C_API bool xml_element_name_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName )
+{
+  return (_elem && _elem->name && _elem->nsId==_nsId && 0==strcmp(_elem->localName,_localName));
+}
+
+XML_C_API bool xml_attribute_name_ns( XmlAttribute* _attr, unsigned int _nsId, const char* _localName )
+{
+  return (_attr && _attr->nsId==_nsId && 0==strcmp(_attr->localName,_localName));
+}
+
+// namespace resolution
+
+static const char xml_namespace_xml[] = "http://www.w3.org/XML/1998/namespace";
+static const char xml_namespace_xmlns[] = "http://www.w3.org/2000/xmlns/";
+
+static const char* xml_local_name( const char* _name )
+{
+  const char* colon = strchr(_name,':');
+  return colon ? colon+1 : _name;
+}
+
+// id of _uri, a new URI is appended to the table
+static unsigned int xml_namespace_intern( XmlDocument* _doc, const char* _uri )
+{
+  for (size_t i=0; i<_doc->nNamespaces; ++i)
+  {
+    if (0==strcmp(_doc->namespaces[i],_uri)) return (unsigned int)(i+1);
+  }
+  _doc->namespaces[_doc->nNamespaces++] = _uri;
+  return (unsigned int) _doc->nNamespaces;
+}
+
+// namespace of a name, the innermost binding of its prefix wins
+static unsigned int xml_namespace_lookup( XmlDocument* _doc, const XmlNamespaceBinding* _bindings, size_t _nBindings, const char* _name, const char* _localName, bool _attribute )
+{
+  size_t size = _localName==_name ? 0 : (size_t)(_localName-_name)-1;
+  if (0==size && _attribute)
+  {
+    // the default namespace doesn't apply to attributes
+    return 0==strcmp(_name,"xmlns") ? xml_namespace_intern(_doc,xml_namespace_xmlns) : 0;
+  }
+  if (3==size && 0==memcmp(_name,"xml",3)) return xml_namespace_intern(_doc,xml_namespace_xml);
+  if (5==size && 0==memcmp(_name,"xmlns",5)) return xml_namespace_intern(_doc,xml_namespace_xmlns);
+  while (_nBindings--)
+  {
+    const XmlNamespaceBinding* binding = _bindings + _nBindings;
+    if (binding->size==size && 0==memcmp(binding->prefix,_name,size)) return binding->nsId;
+  }
+  return 0;
+}
+
+// push the xmlns declarations of _elem
+static void xml_namespace_bind( XmlDocument* _doc, XmlNamespaceBinding* _bindings, size_t* _nBindings, XmlElement* _elem )
+{
+  for (XmlAttribute* iter = _elem->attributes; iter; iter = iter->next)
+  {
+    const char* name = iter->name;
+    if (0==strncmp(name,"xmlns",5) && (0==name[5] || ':'==name[5]))
+    {
+      XmlNamespaceBinding* binding = _bindings + (*_nBindings)++;
+      binding->prefix = name[5] ? name+6 : name+5;
+      binding->size = strlen(binding->prefix);
+      binding->nsId = iter->content[0] ? xml_namespace_intern(_doc,iter->content) : 0;
+      binding->owner = _elem;
+    }
+  }
+}
+
+// the start tag of _elem is complete: push its xmlns declarations and resolve
+// the element and attribute names. the caller provides room for one binding
+// per attribute and one URI per attribute plus the two predefined ones.
+static void xml_namespace_resolve( XmlDocument* _doc, XmlNamespaceBinding* _bindings, size_t* _nBindings, XmlElement* _elem )
+{
+  XmlAttribute* iter;
+  xml_namespace_bind(_doc,_bindings,_nBindings,_elem);
+  _elem->nsId = xml_namespace_lookup(_doc,_bindings,*_nBindings,_elem->name,_elem->localName,false);
+  for (iter = _elem->attributes; iter; iter = iter->next)
+  {
+    iter->nsId = xml_namespace_lookup(_doc,_bindings,*_nBindings,iter->name,iter->localName,true);
+  }
+}
+
+// the document has no xmlns declarations: only the xml prefix is bound, and
+// the names without a prefix have no namespace
+static void xml_namespace_resolve_predefined( XmlDocument* _doc, XmlElement* _elem )
+{
+  XmlAttribute* iter;
+  if (_elem->localName!=_elem->name) _elem->nsId = xml_namespace_lookup(_doc,0,0,_elem->name,_elem->localName,false);
+  for (iter = _elem->attributes; iter; iter = iter->next)
+  {
+    if (iter->localName!=iter->name) iter->nsId = xml_namespace_lookup(_doc,0,0,iter->name,iter->localName,true);
+  }
+}
+
+// the declarations of _scope and its ancestors, the outermost first
+static void xml_namespace_inherit( XmlDocument* _doc, XmlNamespaceBinding* _bindings, size_t* _nBindings, XmlElement* _scope )
+{
+  if (0==_scope) return;
+  xml_namespace_inherit(_doc,_bindings,_nBindings,_scope->parent);
+  xml_namespace_bind(_doc,_bindings,_nBindings,_scope);
+}
+
+// _elem is closed, its declarations go out of scope
+static void xml_namespace_pop( const XmlNamespaceBinding* _bindings, size_t* _nBindings, XmlElement* _elem )
+{
+  while (*_nBindings && _bindings[*_nBindings-1].owner==_elem) (*_nBindings)--;
+}
+
+XML_C_API unsigned int xml_namespace_id( XmlElement* _elem, const char* _uri )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_elem);
+  if (document && _uri)
+  {
+    for (size_t i=0; i<document->nNamespaces; ++i)
+    {
+      if (0==strcmp(document->namespaces[i],_uri)) return (unsigned int)(i+1);
+    }
+  }
+  return XML_NAMESPACE_UNKNOWN;
+}
+
+XML_C_API const char* xml_namespace_uri( XmlElement* _elem, unsigned int _nsId )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_elem);
+  if (document && _nsId>0 && _nsId<=document->nNamespaces) return document->namespaces[_nsId-1];
+  return 0;
 }
 
-// enqueue the attribute entry at the end of the attributes list
+// enqueue the attribute entry at the end of the attributes list. the
+// attributes of an element are allocated one after the other, so the last
+// one is at hand.
 static void xml_element_add_attribute( XmlElement* self, XmlAttribute* attribute )
 {
-  if (0==self->attributes)
+  if (0==self->attributeCount)
   {
     self->attributes = attribute;
   }
   else
   {
-    XmlAttribute* iter = self->attributes;
-    while (iter->next) iter = iter->next;
-    iter->next = attribute;
+    self->attributes[self->attributeCount-1].next = attribute;
+  }
+  self->attributeCount++;
+}
+
+// attribute index of wide elements: open addressing over the local names,
+// index[0] is the mask, the slots hold the attribute number + 1
+
+static size_t xml_attribute_index_size( size_t _count )
+{
+  size_t slots = 8;
+  while (slots < 2*_count) slots *= 2;
+  return ((slots+1)*sizeof(unsigned int) + sizeof(void*)-1) & ~(sizeof(void*)-1);
+}
+
+static void xml_attribute_index_build( XmlElement* _elem, unsigned int* _index )
+{
+  if (0==_index) return;
+  size_t slots = 8;
+  while (slots < 2*_elem->attributeCount) slots *= 2;
+  unsigned int* slot = _index+1;
+  _index[0] = (unsigned int)(slots-1);
+  for (size_t i=0; i<_elem->attributeCount; ++i)
+  {
+    const char* local = _elem->attributes[i].localName;
+    size_t h = xml_hint_hash(local,strlen(local)) & _index[0];
+    while (slot[h]) h = (h+1) & _index[0];
+    slot[h] = (unsigned int)(i+1);
+  }
+  _elem->attributeIndex = _index;
+}
+
+// attributes with the same local name are probed in document order, so the
+// first match is the first one in the list. _value follows xml_name_match.
+static XmlAttribute* xml_attribute_index_find( XmlElement* _elem, const char* _value, const char* _local, unsigned int _nsId, bool _ns )
+{
+  const unsigned int* index = _elem->attributeIndex;
+  size_t h = xml_hint_hash(_local,strlen(_local)) & index[0];
+  for (; index[1+h]; h = (h+1) & index[0])
+  {
+    XmlAttribute* attr = _elem->attributes + index[1+h]-1;
+    if (_ns ? (attr->nsId==_nsId && 0==strcmp(attr->localName,_local)) : xml_name_match(attr->name,attr->localName,_value)) return attr;
   }
+  return 0;
 }
 
 // enqueue the element at the end of the elements list
@@ -209,7 +549,8 @@ static void xml_element_add_element( XmlElement* self, XmlElement* child )
   self->tail = child;
 }
 
-XML_C_API XmlElement* xml_element_find_element_by_attribute_value( XmlElement* self, const char* _elemName, const char* _attrName, const char* _attrValue )
+// the search of xml_element_find_element_by_attribute_value, without the cache
+static XmlElement* xml_element_find_by_attribute_value( XmlElement* self, const char* _elemName, const char* _attrName, const char* _attrValue )
 {
   if (self->name && xml_element_name(self,_elemName))
   {
@@ -230,7 +571,7 @@ XML_C_API XmlElement* xml_element_find_element_by_attribute_value( XmlElement* s
   XmlElement* iter = self->elements;
   while (iter)
   {
-    XmlElement* e = xml_element_find_element_by_attribute_value(iter,_elemName,_attrName,_attrValue);
+    XmlElement* e = xml_element_find_by_attribute_value(iter,_elemName,_attrName,_attrValue);
     if (e) return e;
     iter = iter->next;
   }
@@ -303,9 +644,9 @@ XML_C_API XmlElement* xml_element_find_any( XmlElement* _elem, const char* _name
   return 0;
 }
 
-XML_C_API unsigned int xml_element_find_elements( XmlElement* self, const char* _name, XmlElement* _begin[], XmlElement* _end[] )
+XML_C_API size_t xml_element_find_elements( XmlElement* self, const char* _name, XmlElement* _begin[], XmlElement* _end[] )
 {
-  unsigned int count = 0;
+  size_t count = 0;
 
   if (_name==0 || xml_element_name(self,_name))
   {
@@ -327,9 +668,9 @@ XML_C_API unsigned int xml_element_find_elements( XmlElement* self, const char*
   return count;
 }
 
-XML_C_API unsigned int xml_element_find_elements_by_attribute( XmlElement* self, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ )
+XML_C_API size_t xml_element_find_elements_by_attribute( XmlElement* self, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ )
 {
-  unsigned int count = 0;
+  size_t count = 0;
 
   XmlAttribute* attr = self->attributes;
   while (attr)
@@ -356,9 +697,9 @@ XML_C_API unsigned int xml_element_find_elements_by_attribute( XmlElement* self,
   return count;
 }
 
-XML_C_API unsigned int xml_element_find_attributes( XmlElement* self, const char* _name, XmlAttribute* _begin[], XmlAttribute* _end[] )
+XML_C_API size_t xml_element_find_attributes( XmlElement* self, const char* _name, XmlAttribute* _begin[], XmlAttribute* _end[] )
 {
-  unsigned int count = 0;
+  size_t count = 0;
   XmlAttribute* iter = self->attributes;
 
   while (iter)
@@ -382,6 +723,7 @@ XML_C_API unsigned int xml_element_find_attributes( XmlElement* self, const char
 XML_C_API XmlAttribute* xml_element_find_attribute( XmlElement* self, const char* _name, XmlAttribute* _attribute )
 {
   if (self==0) return 0;
+  if (self->attributeIndex && 0==_attribute) return xml_attribute_index_find(self,_name,xml_local_name(_name),0,false);
   XmlAttribute* iter = _attribute ? _attribute : self->attributes;
   while (iter)
   {
@@ -391,154 +733,665 @@ XML_C_API XmlAttribute* xml_element_find_attribute( XmlElement* self, const char
   return 0;
 }
 
-XML_C_API XmlElement* xml_element_get_root(XmlElement* _e)
+XML_C_API XmlElement* xml_element_find_element_ns( XmlElement* self, unsigned int _nsId, const char* _localName, XmlElement* _element )
 {
-  while (_e && _e->parent) _e = _e->parent;
-  return _e;
+  XmlElement* iter = _element ? _element->next : self->elements;
+  while (iter)
+  {
+    if (xml_element_name_ns(iter,_nsId,_localName)) return iter;
+    iter = iter->next;
+  }
+  return 0;
 }
 
-// concatenate all child elements that are content elements (name==0)
-// *NOT* useful for SVG and HTML
-XML_C_API unsigned int xml_element_get_content( XmlElement* self, char* _buffer, unsigned int _size )
+XML_C_API XmlElement* xml_element_find_any_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName )
 {
-  unsigned int size = 0;
-  XmlElement* iter = self->elements;
+  if (xml_element_name_ns(_elem,_nsId,_localName)) return _elem;
+
+  XmlElement* iter = _elem->elements;
   while (iter)
   {
-    if (0==iter->name)
-    {
-      int i=0;
-      while (iter->content[i])
-      {
-        if (_buffer && size<_size) _buffer[size] = iter->content[i];
-        size++;
-        i++;
-      }
-    }
-    //    size += xml_element_get_content(iter,_buffer+size,_size);
+    XmlElement* e = xml_element_find_any_ns(iter,_nsId,_localName);
+    if (e) return e;
     iter = iter->next;
   }
-  return size;
+  return 0;
 }
 
-// allocMem memory. two pools are used - one for strings and one for 4-byte aligned structs
-static void* xml_alloc_memory( XmlScannerContext* _ctx, const unsigned int _bytes, bool _string )
+XML_C_API XmlAttribute* xml_element_find_attribute_ns( XmlElement* self, unsigned int _nsId, const char* _localName, XmlAttribute* _attribute )
 {
-  char* pointer = (char*) _ctx->pRoot;
-  if (_string)
-  {
-    if ( (_ctx->nUsedChars + _bytes) > _ctx->nChars ) return 0;
-    pointer += ( _ctx->nBytes + _ctx->nUsedChars );
-    _ctx->nUsedChars += _bytes;
-  }
-  else
+  if (self==0) return 0;
+  if (self->attributeIndex && 0==_attribute) return xml_attribute_index_find(self,0,_localName,_nsId,true);
+  XmlAttribute* iter = _attribute ? _attribute : self->attributes;
+  while (iter)
   {
-    if ( (_ctx->nUsedBytes + _bytes) > _ctx->nBytes ) return 0;
-    pointer += _ctx->nUsedBytes;
-    _ctx->nUsedBytes += _bytes;
+    if (xml_attribute_name_ns(iter,_nsId,_localName)) return iter;
+    iter = iter->next;
   }
-  return pointer;
+  return 0;
 }
 
-// create a zero-terminated string clone
-static char* xml_clone_string( XmlScannerContext* _ctx, const char* _str, const unsigned int _size, const bool _escape )
+XML_C_API size_t xml_element_find_elements_ns( XmlElement* self, unsigned int _nsId, const char* _localName, XmlElement* _begin[], XmlElement* _end[] )
 {
-  char* str = (char*) xml_alloc_memory(_ctx,_size+1,true);
-  if (str)
+  size_t count = 0;
+
+  if (xml_element_name_ns(self,_nsId,_localName))
   {
-    unsigned int i=0, j=0;
-    for (; i<_size;i++,j++)
+    if (_begin < _end)
     {
-      if (_escape && _str[i]=='&')
-      {
-        if (xml_compare(_str+i,"&lt;")) { str[j]='<'; i+=3; }
-        else if (xml_compare(_str+i,"&gt;")) { str[j]='>'; i+=3; }
-        else if (xml_compare(_str+i,"&amp;")) { str[j]='&'; i+=4; }
-        else if (xml_compare(_str+i,"&quot;")) { str[j]='\''; i+=5; }
-        else
-        {
-          // skip unknown entity
-          while (_str[i]!=';' && i<_size) i++;
-        }
-      }
-      else str[j] = _str[i];
+      *_begin = self;
     }
-    str[j]=0;
+    count++;
   }
-  return str;
+
+  XmlElement* iter = self->elements;
+
+  while (iter)
+  {
+    count += xml_element_find_elements_ns(iter,_nsId,_localName,_begin ? _begin+count : 0,_end);
+    iter = iter->next;
+  }
+
+  return count;
 }
 
-// scanning is performed in two passes, the first one (_scanonly=true) is used to estimate the memory usage,
-// whereas the second pass (_scanonly=false) will construct the XML document tree.
-// the complete document will be placed into one single memory block, this is cache friendly and does not
-// fragment the memory manager.
-static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _element, const char* _begin, const char* _end, bool _scanonly )
+// result buffers and cursors
+
+#ifdef _MSC_VER
+#define XML_THREAD_LOCAL __declspec(thread)
+#else
+#define XML_THREAD_LOCAL __thread
+#endif
+
+static XML_THREAD_LOCAL XmlResults xml_scratch_results;
+
+XML_C_API void xml_results_init( XmlResults* _results, const XmlArena* _arena )
 {
-  const char* marker = 0;
-  // TODO check if _begin<_end is correct (valgrind demanded this!)
-  while( _begin && _begin<_end && *_begin )
+  memset(_results,0,sizeof(XmlResults));
+  _results->arena = (_arena && _arena->alloc) ? _arena : 0;	// like xml_create_ex
+}
+
+XML_C_API void xml_results_clear( XmlResults* _results )
+{
+  _results->count = 0;
+}
+
+XML_C_API void xml_results_free( XmlResults* _results )
+{
+  if (_results->items)
   {
-    if (_begin >= _end) return 0;
-    char c = *_begin++;
-    if ('<'==c)
+    if (_results->arena==0) free(_results->items);
+    else if (_results->arena->free) _results->arena->free(_results->arena->context,_results->items,_results->capacity*sizeof(void*));
+  }
+  _results->items = 0;
+  _results->count = 0;
+  _results->capacity = 0;
+}
+
+XML_C_API XmlResults* xml_results_scratch( void )
+{
+  xml_scratch_results.count = 0;
+  return &xml_scratch_results;
+}
+
+static bool xml_results_push( XmlResults* _results, void* _item )
+{
+  if (_results->count == _results->capacity)
+  {
+    size_t capacity = _results->capacity ? 2*_results->capacity : 64;
+    void** items;
+    if (_results->arena)
     {
-      if (marker)
-      {
-        int n = _begin-marker-1;
-        if (_scanonly)
-        {
-          _ctx->nChars += n+1;
-          _ctx->nBytes += sizeof(XmlElement);
-        }
-        else
-        {
-          XmlElement* text = (XmlElement*) xml_alloc_memory(_ctx,sizeof(XmlElement),false);
-          text->content = xml_clone_string(_ctx,marker,n,true);
-          text->name = 0;
+      // arenas can't grow in place: copy and give the old buffer back
+      items = (void**) _results->arena->alloc(_results->arena->context,capacity*sizeof(void*));
+      if (items==0) return false;
+      if (_results->count) memcpy(items,_results->items,_results->count*sizeof(void*));
+      if (_results->items && _results->arena->free) _results->arena->free(_results->arena->context,_results->items,_results->capacity*sizeof(void*));
+    }
+    else
+    {
+      items = (void**) realloc(_results->items,capacity*sizeof(void*));
+      if (items==0) return false;
+    }
+    _results->items = items;
+    _results->capacity = capacity;
+  }
+  _results->items[_results->count++] = _item;
+  return true;
+}
 
-          // convenience
-          _element->content = text->content;
+#define XML_CURSOR_NAME       0
+#define XML_CURSOR_NS         1
+#define XML_CURSOR_ATTRIBUTE  2
 
-          xml_element_add_element( _element, text );
-        }
-        marker = 0;
-      }
-      bool recurse = true;
-      bool allocate = false;
-      XmlElement* element = 0;
-      if ('!' == *_begin) // skip comments, cdata, dtds, doctypes. not supported
-      {
-        int nesting=1;
-        if (xml_compare(_begin,"![CDATA["))
-        {
-          _begin+=8;	// skip '![CDATA['
-          const char* end = strstr(_begin,"]]>");
-          if (end)
-          {
-            int n = end - _begin;
-            if (_scanonly)
-            {
-              _ctx->nChars += n+1;
-              _ctx->nBytes += sizeof(XmlElement);
-            }
-            else
-            {
-              XmlElement* text = (XmlElement*) xml_alloc_memory(_ctx,sizeof(XmlElement),false);
-              text->content = xml_clone_string(_ctx,_begin,n,false);
-              text->name = 0;
+// pre-order successor of _elem below _root: first child, else the next
+// sibling of the nearest ancestor that has one
+static XmlElement* xml_cursor_step( XmlElement* _root, XmlElement* _elem )
+{
+  if (_elem->elements) return _elem->elements;
+  while (_elem != _root)
+  {
+    if (_elem->next) return _elem->next;
+    _elem = _elem->parent;
+  }
+  return 0;
+}
 
-              // convenience
-              _element->content = text->content;
+XML_C_API void xml_cursor_init( XmlCursor* _cursor, XmlElement* _elem, const char* _name )
+{
+  memset(_cursor,0,sizeof(XmlCursor));
+  _cursor->root = _elem;
+  _cursor->name = _name;
+  _cursor->mode = XML_CURSOR_NAME;
+}
 
-              xml_element_add_element( _element,text );
-            }
+XML_C_API void xml_cursor_init_ns( XmlCursor* _cursor, XmlElement* _elem, unsigned int _nsId, const char* _localName )
+{
+  memset(_cursor,0,sizeof(XmlCursor));
+  _cursor->root = _elem;
+  _cursor->localName = _localName;
+  _cursor->nsId = _nsId;
+  _cursor->mode = XML_CURSOR_NS;
+}
 
-            _begin = end+3; // "]]>"
-          }
-          else
-          {
-            if (_ctx->errorHandler) _ctx->errorHandler("unterminated CDATA",_ctx->begin,_begin);
-            return 0;
+XML_C_API void xml_cursor_init_attribute( XmlCursor* _cursor, XmlElement* _elem, const char* _name )
+{
+  memset(_cursor,0,sizeof(XmlCursor));
+  _cursor->root = _elem;
+  _cursor->name = _name;
+  _cursor->mode = XML_CURSOR_ATTRIBUTE;
+}
+
+XML_C_API XmlElement* xml_cursor_next( XmlCursor* _cursor )
+{
+  XmlElement* root = _cursor->root;
+  XmlElement* iter = _cursor->element;
+  if (root==0) return 0;    // done
+  if (iter && _cursor->mode==XML_CURSOR_ATTRIBUTE)
+  {
+    // the same element again for its next matching attribute
+    XmlAttribute* next = _cursor->attribute->next;
+    _cursor->attribute = next ? xml_element_find_attribute(iter,_cursor->name,next) : 0;
+    if (_cursor->attribute) return iter;
+  }
+  for (iter = iter ? xml_cursor_step(root,iter) : root; iter; iter = xml_cursor_step(root,iter))
+  {
+    bool match;
+    switch (_cursor->mode)
+    {
+    case XML_CURSOR_NS:
+      match = xml_element_name_ns(iter,_cursor->nsId,_cursor->localName);
+      break;
+    case XML_CURSOR_ATTRIBUTE:
+      _cursor->attribute = xml_element_find_attribute(iter,_cursor->name,0);
+      match = _cursor->attribute!=0;
+      break;
+    default:
+      match = _cursor->name==0 || xml_element_name(iter,_cursor->name);
+      break;
+    }
+    if (match)
+    {
+      _cursor->element = iter;
+      return iter;
+    }
+  }
+  _cursor->root = 0;
+  _cursor->element = 0;
+  _cursor->attribute = 0;
+  return 0;
+}
+
+static bool xml_results_collect( XmlCursor* _cursor, XmlResults* _results )
+{
+  for (XmlElement* iter = xml_cursor_next(_cursor); iter; iter = xml_cursor_next(_cursor))
+  {
+    if (!xml_results_push(_results,iter)) return false;
+  }
+  return true;
+}
+
+XML_C_API bool xml_element_collect_elements( XmlElement* _elem, const char* _name, XmlResults* _results )
+{
+  XmlCursor cursor;
+  xml_cursor_init(&cursor,_elem,_name);
+  return xml_results_collect(&cursor,_results);
+}
+
+XML_C_API bool xml_element_collect_elements_by_attribute( XmlElement* _elem, const char* _name, XmlResults* _results )
+{
+  XmlCursor cursor;
+  xml_cursor_init_attribute(&cursor,_elem,_name);
+  return xml_results_collect(&cursor,_results);
+}
+
+XML_C_API bool xml_element_collect_elements_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName, XmlResults* _results )
+{
+  XmlCursor cursor;
+  xml_cursor_init_ns(&cursor,_elem,_nsId,_localName);
+  return xml_results_collect(&cursor,_results);
+}
+
+XML_C_API bool xml_element_collect_attributes( XmlElement* _elem, const char* _name, XmlResults* _results )
+{
+  for (XmlAttribute* iter = _elem->attributes; iter; iter = iter->next)
+  {
+    if (xml_attribute_name(iter,_name) && !xml_results_push(_results,iter)) return false;
+  }
+  return true;
+}
+
+XML_C_API XmlElement* xml_element_get_root(XmlElement* _e)
+{
+  while (_e && _e->parent) _e = _e->parent;
+  return _e;
+}
+
+// text nodes of the subtree in document order, _n spans are there already
+static size_t xml_element_spans( XmlElement* _elem, XmlSpan* _spans, size_t _count, size_t _n, size_t* _bytes )
+{
+  for (XmlElement* iter = _elem->elements; iter; iter = iter->next)
+  {
+    if (iter->name)
+    {
+      _n = xml_element_spans(iter,_spans,_count,_n,_bytes);
+    }
+    else
+    {
+      size_t size = strlen(iter->content);
+      if (_n < _count)
+      {
+        _spans[_n].data = iter->content;
+        _spans[_n].size = size;
+      }
+      if (_bytes) *_bytes += size;
+      _n++;
+    }
+  }
+  return _n;
+}
+
+XML_C_API size_t xml_element_get_spans( XmlElement* _elem, XmlSpan* _spans, size_t _count, size_t* _bytes )
+{
+  if (_bytes) *_bytes = 0;
+  return _elem ? xml_element_spans(_elem,_spans,_count,0,_bytes) : 0;
+}
+
+// _used bytes are written already
+static size_t xml_element_copy_content( XmlElement* _elem, char* _buffer, size_t _size, size_t _used )
+{
+  for (XmlElement* iter = _elem->elements; iter; iter = iter->next)
+  {
+    if (iter->name)
+    {
+      _used = xml_element_copy_content(iter,_buffer,_size,_used);
+    }
+    else
+    {
+      size_t size = strlen(iter->content);
+      if (_buffer && _used < _size) memcpy(_buffer+_used,iter->content,size < _size-_used ? size : _size-_used);
+      _used += size;
+    }
+  }
+  return _used;
+}
+
+// concatenate the text nodes (name==0) of the whole subtree
+// *NOT* useful for SVG and HTML
+XML_C_API size_t xml_element_get_content( XmlElement* self, char* _buffer, size_t _size )
+{
+  return self ? xml_element_copy_content(self,_buffer,_size,0) : 0;
+}
+
+// structural hashing, murmur64A for the strings
+
+static XmlHash xml_hash_mix( XmlHash _h )
+{
+  _h ^= _h >> 33;
+  _h *= 0xff51afd7ed558ccdULL;
+  _h ^= _h >> 33;
+  _h *= 0xc4ceb9fe1a85ec53ULL;
+  _h ^= _h >> 33;
+  return _h;
+}
+
+static XmlHash xml_hash_string( const char* _str, XmlHash _seed )
+{
+  const XmlHash m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  size_t size = _str ? strlen(_str) : 0;
+  XmlHash h = _seed ^ (size * m);
+  const char* end = _str + (size & ~(size_t)7);
+  for (; _str<end; _str+=8)
+  {
+    XmlHash k;
+    memcpy(&k,_str,8);
+    k *= m; k ^= k >> r; k *= m;
+    h ^= k;
+    h *= m;
+  }
+  size &= 7;
+  if (size)
+  {
+    // the tail, byte i goes to bits 8*i
+    while (size--) h ^= (XmlHash)(unsigned char)_str[size] << (8*size);
+    h *= m;
+  }
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// hash one element. children that are not hashed yet (or all of them, if
+// _recurse is set) are hashed first.
+static XmlHash xml_element_hash_node( XmlElement* _elem, bool _recurse )
+{
+  XmlHash h;
+  if (0==_elem->name)
+  {
+    h = xml_hash_string(_elem->content,0x74657874);
+  }
+  else
+  {
+    XmlHash attributes = 0;
+    XmlAttribute* attr = _elem->attributes;
+    XmlElement* iter = _elem->elements;
+    // attribute order is not significant, so their hashes are just added up
+    for (; attr; attr = attr->next)
+    {
+      attributes += xml_hash_mix(xml_hash_string(attr->content,xml_hash_string(attr->name,0x61747472)));
+    }
+    h = xml_hash_mix(xml_hash_string(_elem->name,0x656c656d) ^ xml_hash_mix(attributes));
+    for (; iter; iter = iter->next)
+    {
+      if (_recurse || 0==iter->hash) xml_element_hash_node(iter,_recurse);
+      h = xml_hash_mix(h*31 + iter->hash);
+    }
+  }
+  if (0==h) h = 1;		// 0 means "not computed"
+  _elem->hash = h;
+  return h;
+}
+
+XML_C_API XmlHash xml_element_compute_hash( XmlElement* _elem )
+{
+  return _elem ? xml_element_hash_node(_elem,true) : 0;
+}
+
+// compare name, text and attributes, but not the children
+static bool xml_element_equal_shallow( XmlElement* _a, XmlElement* _b )
+{
+  size_t count = 0;
+  XmlAttribute* attr;
+  if ((0==_a->name) != (0==_b->name)) return false;
+  if (0==_a->name) return 0==strcmp(_a->content,_b->content);
+  if (0!=strcmp(_a->name,_b->name)) return false;
+  for (attr = _b->attributes; attr; attr = attr->next) count++;
+  for (attr = _a->attributes; attr; attr = attr->next)
+  {
+    XmlAttribute* iter = _b->attributes;
+    while (iter && 0!=strcmp(iter->name,attr->name)) iter = iter->next;
+    if (0==iter || 0!=strcmp(iter->content,attr->content)) return false;
+    count--;
+  }
+  return 0==count;
+}
+
+XML_C_API bool xml_element_equal_fast( XmlElement* _a, XmlElement* _b )
+{
+  if (_a==_b) return true;
+  if (_a==0 || _b==0) return false;
+  if (_a->hash && _b->hash) return _a->hash==_b->hash;
+  if (!xml_element_equal_shallow(_a,_b)) return false;
+  XmlElement* a = _a->elements;
+  XmlElement* b = _b->elements;
+  for (; a && b; a = a->next, b = b->next)
+  {
+    if (!xml_element_equal_fast(a,b)) return false;
+  }
+  return a==b;
+}
+
+// both are text nodes or elements with the same name, so one can be diffed against the other
+static bool xml_element_matches( XmlElement* _a, XmlElement* _b )
+{
+  if (_a->hash==_b->hash) return true;
+  if (0==_a->name || 0==_b->name) return _a->name==_b->name;
+  return 0==strcmp(_a->name,_b->name);
+}
+
+static size_t xml_element_diff( XmlElement* _old, XmlElement* _new, XmlDiffFunc _func, void* _param )
+{
+  size_t count = 0;
+  if (_old->hash && _old->hash==_new->hash) return 0;
+  if (!xml_element_equal_shallow(_old,_new))
+  {
+    if (_func) _func(XML_DIFF_CHANGED,_old,_new,_param);
+    count++;
+    if (0==_old->name || 0==_new->name) return count;
+  }
+
+  // walk both child lists. a mismatch is an insertion if the old child shows
+  // up as the next new one, a removal in the opposite case, a change otherwise.
+  // the hashes are looked at before the names, or one row inserted into a list
+  // of same-named rows would show up as a change of every row after it.
+  XmlElement* a = _old->elements;
+  XmlElement* b = _new->elements;
+  while (a && b)
+  {
+    if (a->hash && a->hash==b->hash)
+    {
+      a = a->next;
+      b = b->next;
+    }
+    else if (a->hash && b->next && a->hash==b->next->hash)
+    {
+      if (_func) _func(XML_DIFF_ADDED,0,b,_param);
+      count++;
+      b = b->next;
+    }
+    else if (b->hash && a->next && a->next->hash==b->hash)
+    {
+      if (_func) _func(XML_DIFF_REMOVED,a,0,_param);
+      count++;
+      a = a->next;
+    }
+    else if (xml_element_matches(a,b))
+    {
+      count += xml_element_diff(a,b,_func,_param);
+      a = a->next;
+      b = b->next;
+    }
+    else
+    {
+      if (_func) _func(XML_DIFF_CHANGED,a,b,_param);
+      count++;
+      a = a->next;
+      b = b->next;
+    }
+  }
+  for (; a; a = a->next, count++) if (_func) _func(XML_DIFF_REMOVED,a,0,_param);
+  for (; b; b = b->next, count++) if (_func) _func(XML_DIFF_ADDED,0,b,_param);
+  return count;
+}
+
+XML_C_API size_t xml_document_diff( XmlElement* _old, XmlElement* _new, XmlDiffFunc _func, void* _param )
+{
+  if (_old==0 || _new==0) return 0;
+  if (0==_old->hash) xml_element_compute_hash(_old);
+  if (0==_new->hash) xml_element_compute_hash(_new);
+  return xml_element_diff(_old,_new,_func,_param);
+}
+
+// allocMem memory. two pools are used - one for strings and one for 4-byte aligned structs
+static void* xml_alloc_memory( XmlScannerContext* _ctx, const size_t _bytes, bool _string )
+{
+  char* pointer = (char*) _ctx->pRoot;
+  if (_string)
+  {
+    if ( _bytes > _ctx->nChars - _ctx->nUsedChars ) return 0;		// nUsed <= n, can't wrap
+    pointer += ( _ctx->nBytes + _ctx->nUsedChars );
+    _ctx->nUsedChars += _bytes;
+  }
+  else
+  {
+    if ( _bytes > _ctx->nBytes - _ctx->nUsedBytes ) return 0;
+    pointer += _ctx->nUsedBytes;
+    _ctx->nUsedBytes += _bytes;
+    // structs are cleared when they are handed out (strings are always written
+    // completely), so no page of the block is touched before it is needed
+    if (!_ctx->zeroed) memset(pointer,0,_bytes);
+  }
+  return pointer;
+}
+
+// copy _size bytes to _dst and expand the predefined entities if _escape is set.
+// returns the number of bytes written, which is never more than _size.
+static size_t xml_unescape( char* _dst, const char* _str, const size_t _size, const bool _escape )
+{
+  size_t i=0, j=0;
+  while (i<_size)
+  {
+    if (_escape && _str[i]=='&')
+    {
+      if (xml_compare(_str+i,"&lt;")) { _dst[j++]='<'; i+=4; }
+      else if (xml_compare(_str+i,"&gt;")) { _dst[j++]='>'; i+=4; }
+      else if (xml_compare(_str+i,"&amp;")) { _dst[j++]='&'; i+=5; }
+      else if (xml_compare(_str+i,"&quot;")) { _dst[j++]='\''; i+=6; }
+      else
+      {
+        // skip unknown entity
+        while (i<_size && _str[i]!=';') i++;
+        i++;
+      }
+    }
+    else _dst[j++] = _str[i++];
+  }
+  return j;
+}
+
+// create a zero-terminated string clone
+static char* xml_clone_string( XmlScannerContext* _ctx, const char* _str, const size_t _size, const bool _escape )
+{
+  char* str = (char*) xml_alloc_memory(_ctx,_size+1,true);
+  if (str)
+  {
+    str[xml_unescape(str,_str,_size,_escape)]=0;
+  }
+  return str;
+}
+
+// cut off trailing whitespace of a finished text node (XML_PARSE_TRIM_TEXT)
+static void xml_text_trim( XmlElement* _text )
+{
+  char* str = (char*) _text->content;
+  size_t n = strlen(str);
+  while (n && xml_is_space(str[n-1])) n--;
+  str[n] = 0;
+}
+
+// a text run was scanned: create a text node, append it to the previous one
+// (XML_PARSE_COALESCE_TEXT) or drop it. both passes must take the same
+// decisions, *_inText tells whether the last child of _element is a text node.
+static void xml_document_text( XmlScannerContext* _ctx, XmlElement* _element, bool* _inText, const char* _text, size_t _size, bool _cdata, bool _scanonly )
+{
+  const unsigned int flags = _ctx->flags;
+  if (!_cdata && (flags & XML_PARSE_SKIP_WHITESPACE) && xml_is_blank(_text,_text+_size)) return;
+
+  bool merge = *_inText && (flags & XML_PARSE_COALESCE_TEXT);
+  if (flags & XML_PARSE_TRIM_TEXT)
+  {
+    if (!merge) while (_size && xml_is_space(*_text)) { _text++; _size--; }
+    // when coalescing, the end is trimmed once the run is complete
+    if (!(flags & XML_PARSE_COALESCE_TEXT)) while (_size && xml_is_space(_text[_size-1])) _size--;
+    // nothing left: no empty text node. a run that starts with it starts later
+    if (!merge && 0==_size) return;
+  }
+
+  if (_scanonly)
+  {
+    _ctx->nChars += merge ? _size : _size+1;
+    if (!merge) _ctx->nBytes += sizeof(XmlElement);
+  }
+  else if (merge)
+  {
+    // nothing was allocated from the string pool since this run started.
+    // entities may have left part of the reservation unused, so the text
+    // continues at the end of the run and not at the end of the pool
+    char* str = (char*) _element->tail->content;
+    if (xml_alloc_memory(_ctx,_size,true)==0) return;
+    _ctx->textSize += xml_unescape(str+_ctx->textSize,_text,_size,!_cdata);
+    str[_ctx->textSize] = 0;
+  }
+  else
+  {
+    XmlElement* text = (XmlElement*) xml_alloc_memory(_ctx,sizeof(XmlElement),false);
+    char* str = (char*) xml_alloc_memory(_ctx,_size+1,true);
+    _ctx->textSize = xml_unescape(str,_text,_size,!_cdata);
+    str[_ctx->textSize] = 0;
+    text->content = str;
+    text->name = 0;
+
+    // convenience
+    _element->content = text->content;
+
+    xml_element_add_element( _element, text );
+  }
+  *_inText = true;
+}
+
+// the current text run of _element is complete
+static void xml_document_text_end( XmlScannerContext* _ctx, XmlElement* _element, bool* _inText, bool _scanonly )
+{
+  const unsigned int mask = XML_PARSE_TRIM_TEXT|XML_PARSE_COALESCE_TEXT;
+  if (*_inText && !_scanonly && mask==(_ctx->flags & mask)) xml_text_trim(_element->tail);
+  *_inText = false;
+}
+
+// scanning is performed in two passes, the first one (_scanonly=true) is used to estimate the memory usage,
+// whereas the second pass (_scanonly=false) will construct the XML document tree.
+// the complete document will be placed into one single memory block, this is cache friendly and does not
+// fragment the memory manager.
+static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _element, const char* _begin, const char* _end, bool _scanonly )
+{
+  const char* marker = 0;
+  bool inText = false;    // the last child is a text node
+  const char* parentStart = _ctx->parentStart;	// source position of _element
+  size_t nChildren = 0;		// element children, XML_PARSE_SOURCE_RANGES only
+  // TODO check if _begin<_end is correct (valgrind demanded this!)
+  while( _begin && _begin<_end && *_begin )
+  {
+    if (_begin >= _end) return 0;
+    char c = *_begin++;
+    if ('<'==c)
+    {
+      const char* tagStart = _begin-1;
+      if (marker)
+      {
+        xml_document_text(_ctx,_element,&inText,marker,_begin-marker-1,false,_scanonly);
+        marker = 0;
+      }
+      bool recurse = true;
+      bool allocate = false;
+      size_t nAttributes = 0;
+      XmlElement* element = 0;
+      if ('!' == *_begin) // skip comments, cdata, dtds, doctypes. not supported
+      {
+        size_t nesting=1;
+        if (xml_compare(_begin,"![CDATA["))
+        {
+          _begin+=8;	// skip '![CDATA['
+          const char* end = strstr(_begin,"]]>");
+          if (end)
+          {
+            xml_document_text(_ctx,_element,&inText,_begin,end-_begin,true,_scanonly);
+            _begin = end+3; // "]]>"
+          }
+          else
+          {
+            if (_ctx->errorHandler) _ctx->errorHandler("unterminated CDATA",_ctx->begin,_begin);
+            return 0;
           }
         }
         else if (xml_compare(_begin,"!--"))	// TODO: create comment element?
@@ -568,12 +1421,17 @@ static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _elem
         recurse = false;
       }
 
-      const char* end = scan_identifier(_begin,_end);
+      const char* colon;
+      const char* end = scan_identifier(_begin,_end,&colon);
       if ('/' != *_begin)	// this is not a terminating element
       {
         if (end[-1]=='/') --end;
         allocate = true;
-        size_t elementSize = sizeof(XmlElement) + xml_sizeof(_ctx->sizeofHints,_begin,end-_begin,0,0);
+        xml_document_text_end(_ctx,_element,&inText,_scanonly);
+        size_t hintSize = xml_hint_size(_ctx->hints,_begin,end-_begin);
+        size_t rangeSize = (_ctx->flags & XML_PARSE_SOURCE_RANGES) ? sizeof(XmlSourceRange) : 0;
+        size_t elementSize = sizeof(XmlElement) + rangeSize + hintSize;
+        if (rangeSize) nChildren++;
         if (_scanonly)
         {
           _ctx->nChars += (end-_begin) + 1;
@@ -583,18 +1441,22 @@ static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _elem
         {
           element = (XmlElement*) xml_alloc_memory(_ctx,elementSize,false);
           element->name = xml_clone_string(_ctx,_begin,end-_begin,true);
+          element->localName = colon ? element->name+(colon+1-_begin) : element->name;
           element->content = 0;
+          if (hintSize) element->userdata = (char*)(element+1) + rangeSize;
           xml_element_add_element( _element,element );
         }
       }
       else // this is a terminating element (</name>)
       {
+        xml_document_text_end(_ctx,_element,&inText,_scanonly);
         _begin = scan_whitespace(end,_end);
         if ('>' != _begin[0] && '>' != _begin[1])
         {
           if (_ctx->errorHandler) _ctx->errorHandler("'>' expected",_ctx->begin,_begin);
           return 0;
         }
+        if (nChildren) xml_source_index(_ctx,_element,nChildren,_scanonly);
         return _begin;
       }
       // scan the element (and all attributes)
@@ -626,16 +1488,19 @@ static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _elem
         if (allocate) // scan all attributes
         {
           XmlAttribute* attribute = 0;
-          end = scan_identifier(_begin,_end);
+          end = scan_identifier(_begin,_end,&colon);
+          nAttributes++;
           if (_scanonly)
           {
             _ctx->nChars += (end-_begin) + 1;
             _ctx->nBytes += sizeof(XmlAttribute);
+            if (end-_begin>=5 && 0==memcmp(_begin,"xmlns",5) && (end-_begin==5 || ':'==_begin[5])) _ctx->nDeclarations++;
           }
           else
           {		
             attribute = (XmlAttribute*) xml_alloc_memory(_ctx,sizeof(XmlAttribute),false);
             attribute->name = xml_clone_string(_ctx,_begin,end-_begin,true);
+            attribute->localName = colon ? attribute->name+(colon+1-_begin) : attribute->name;
             attribute->content = "";
             xml_element_add_attribute( element, attribute );
           }
@@ -669,48 +1534,1837 @@ static const char* xml_document_scan( XmlScannerContext* _ctx, XmlElement* _elem
           _begin++;
         }
       }
+      if (allocate && nAttributes > _ctx->attributeHashWidth)
+      {
+        size_t bytes = xml_attribute_index_size(nAttributes);
+        if (_scanonly) _ctx->nBytes += bytes;
+        else xml_attribute_index_build(element,(unsigned int*) xml_alloc_memory(_ctx,bytes,false));
+      }
+      if (element)
+      {
+        if (_ctx->nDeclarations || _ctx->nInherited) xml_namespace_resolve((XmlDocument*)_ctx->pRoot,_ctx->bindings,&_ctx->nBindings,element);
+        else xml_namespace_resolve_predefined((XmlDocument*)_ctx->pRoot,element);
+        if (_ctx->open) _ctx->open(element,_ctx->param);
+      }
       if (allocate && recurse)
       {
         // so, tag ist offen und gescanned, dann rekursion
+        _ctx->parentStart = tagStart;
         _begin = xml_document_scan(_ctx,element,_begin+1,_end,_scanonly);
       }
       if (_begin) _begin++;	// skip '>'
+      if (element && _begin && (_ctx->flags & XML_PARSE_SOURCE_RANGES))
+      {
+        XmlSourceRange* range = (XmlSourceRange*)(element+1);
+        range->offset = tagStart-parentStart;
+        range->length = _begin-tagStart;
+      }
+      // the subtree is complete and still in the cache
+      if (element)
+      {
+        if (_ctx->flags & XML_PARSE_HASH) xml_element_hash_node(element,false);
+        if (_ctx->close) _ctx->close(element,_ctx->param);
+        xml_namespace_pop(_ctx->bindings,&_ctx->nBindings,element);
+      }
     }
     else
     {
       if (0==marker) marker = _begin-1;
     }
   }
+  xml_document_text_end(_ctx,_element,&inText,_scanonly);
+  if (nChildren) xml_source_index(_ctx,_element,nChildren,_scanonly);
   return _begin;
 }
 
 XML_C_API XmlElement* xml_create( const char* _begin, const char* _end, XmlErrorHandler _errorHandler, XmlAllocator _allocate, XmlSizeofHint* _sizeofHints )
 {
-  if (_allocate==0) return 0;
+  return xml_create_ex(_begin,_end,_errorHandler,_allocate,_sizeofHints,0);
+}
+
+XML_C_API XmlElement* xml_create_ex( const char* _begin, const char* _end, XmlErrorHandler _errorHandler, XmlAllocator _allocate, XmlSizeofHint* _sizeofHints, const XmlOptions* _options )
+{
+  // an arena without an alloc function is not used, the XmlAllocator is
+  const XmlArena* arena = (_options && _options->arena && _options->arena->alloc) ? _options->arena : 0;
+  if (_allocate==0 && arena==0) return 0;
 
   XmlScannerContext context = {0};
+  XmlHintTable* compiled = 0;		// a plain hint list is compiled for this call
 
+  if (_options)
+  {
+    context.flags = _options->flags;
+    context.hints = _options->hints;
+    context.open = _options->open;
+    context.close = _options->close;
+    context.param = _options->param;
+    context.attributeHashWidth = _options->attributeHashWidth;
+  }
+  if (0==context.attributeHashWidth) context.attributeHashWidth = XML_ATTRIBUTE_HASH_WIDTH;
+  if (0==context.hints && _sizeofHints)
+  {
+    context.hints = compiled = xml_hint_table_create(_sizeofHints);
+    if (0==compiled)
+    {
+      if (_errorHandler) _errorHandler("out of memory",_begin,_begin);
+      return 0;
+    }
+  }
   context.errorHandler = _errorHandler;
-  context.sizeofHints = _sizeofHints;
   context.begin = _begin;
   context.end = _end;
 
+  XmlElement* root = xml_document_create(&context,_allocate,arena);
+  xml_hint_table_destroy(compiled);
+  return root;
+}
+
+static XmlElement* xml_document_create( XmlScannerContext* _ctx, XmlAllocator _allocate, const XmlArena* _arena )
+{
   // phase #1: estimate exact memory usage
-  context.nChars = 0;
-  context.nBytes = sizeof(XmlElement);		// pRoot element
-  context.nUsedBytes = context.nBytes;				// initial allocation
-  const char* iter = xml_document_scan(&context,0,_begin,_end,true);
+  _ctx->nChars = 0;
+  _ctx->nBytes = sizeof(XmlDocument);		// pRoot element and document header
+  _ctx->nUsedBytes = _ctx->nBytes;				// initial allocation
+  const char* iter = xml_document_scan(_ctx,0,_ctx->begin,_ctx->end,true);
   if (iter != 0)
   {
+    // namespace URI table and the binding stack: one entry per declaration
+    // (plus the predefined xml and xmlns URIs and what a reparse inherits)
+    size_t nNamespaces = _ctx->nDeclarations + 2 + _ctx->nSeedNamespaces;
+    size_t nBindings = _ctx->nDeclarations + _ctx->nInherited;
+    _ctx->nBytes += nNamespaces * sizeof(const char*) + nBindings * sizeof(XmlNamespaceBinding);
+
     // phase #2: scan and construct document tree
-    context.pRoot = (XmlElement*) _allocate( context.nChars + context.nBytes );
-    memset(context.pRoot,0,context.nChars + context.nBytes);
-    context.pRoot->name = "";
-    context.pRoot->content = "";
-    xml_document_scan(&context,context.pRoot,_begin,_end,false);
+    // with a 64-bit size_t the counters can't wrap, on 32-bit hosts the
+    // sum is the one that overflows first
+    if (_ctx->nChars > (size_t)-1 - _ctx->nBytes)
+    {
+      if (_ctx->errorHandler) _ctx->errorHandler("document too large",_ctx->begin,_ctx->end);
+      return 0;
+    }
+    size_t size = _ctx->nChars + _ctx->nBytes;
+    XmlDocument* document = (XmlDocument*) (_arena ? _arena->alloc(_arena->context,size) : _allocate(size));
+    if (document==0)
+    {
+      if (_ctx->errorHandler) _ctx->errorHandler("out of memory",_ctx->begin,_ctx->begin);
+      return 0;
+    }
+    _ctx->zeroed = _arena && _arena->zeroed;
+    if (!_ctx->zeroed) memset(document,0,sizeof(XmlDocument));
+    if (_arena) document->arena = *_arena;
+    document->size = size;
+    document->flags = _ctx->flags;
+    document->source.length = _ctx->end - _ctx->begin;
+    _ctx->pRoot = &document->root;
+    _ctx->pRoot->name = "";
+    _ctx->pRoot->localName = "";
+    _ctx->pRoot->content = "";
+    document->namespaces = (const char**) xml_alloc_memory(_ctx,nNamespaces * sizeof(const char*),false);
+    _ctx->bindings = (XmlNamespaceBinding*) xml_alloc_memory(_ctx,nBindings * sizeof(XmlNamespaceBinding),false);
+    if (_ctx->nSeedNamespaces) memcpy(document->namespaces,_ctx->seedNamespaces,_ctx->nSeedNamespaces * sizeof(const char*));
+    document->nNamespaces = _ctx->nSeedNamespaces;
+    xml_namespace_inherit(document,_ctx->bindings,&_ctx->nBindings,_ctx->scope);
+    _ctx->parentStart = _ctx->begin;
+    xml_document_scan(_ctx,_ctx->pRoot,_ctx->begin,_ctx->end,false);
+    if (_ctx->flags & XML_PARSE_HASH) xml_element_hash_node(_ctx->pRoot,false);
   }
 
-  return context.pRoot;
+  return _ctx->pRoot;
+}
+
+static void xml_query_cache_free( XmlDocument* _document );
+
+XML_C_API void xml_destroy( XmlElement* _root )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_root);
+  if (document) xml_query_cache_free(document);
+  while (document && document->fragments)
+  {
+    XmlDocument* fragment = document->fragments;
+    document->fragments = fragment->fragments;
+    if (fragment->arena.free) fragment->arena.free(fragment->arena.context,fragment,fragment->size);
+  }
+  if (document && document->arena.free)
+  {
+    document->arena.free(document->arena.context,document,document->size);
+  }
+}
+
+// frozen documents. the cache is a fixed table of slots, an entry is written
+// once and published with a compare-and-swap, readers need a single acquire
+// load. entries are never replaced, a full neighbourhood means the result
+// isn't cached.
+
+#define XML_QUERY_PROBES 8
+
+enum
+{
+  XML_QUERY_ELEMENT_BY_ATTRIBUTE_VALUE = 1
+};
+
+struct _XmlQueryEntry
+{
+  XmlHash             key;
+  int                 kind;
+  XmlElement*         start;
+  const char*         args[3];    // copies, they follow the entry
+  XmlElement*         result;
+};
+
+struct _XmlQueryCache
+{
+  size_t              mask;
+  XmlQueryEntry**     slots;
+};
+
+#ifdef _MSC_VER
+#include <intrin.h>
+static XmlQueryEntry* xml_atomic_load( XmlQueryEntry** _slot )
+{
+  return (XmlQueryEntry*) _InterlockedCompareExchangePointer((void* volatile*)_slot,0,0);
+}
+static bool xml_atomic_publish( XmlQueryEntry** _slot, XmlQueryEntry* _entry )
+{
+  return 0==_InterlockedCompareExchangePointer((void* volatile*)_slot,_entry,0);
+}
+static long xml_atomic_add( long* _value, long _add )	// returns the old value
+{
+  return _InterlockedExchangeAdd((volatile long*)_value,_add);
+}
+#else
+static XmlQueryEntry* xml_atomic_load( XmlQueryEntry** _slot )
+{
+  return __atomic_load_n(_slot,__ATOMIC_ACQUIRE);
+}
+static bool xml_atomic_publish( XmlQueryEntry** _slot, XmlQueryEntry* _entry )
+{
+  XmlQueryEntry* expected = 0;
+  return __atomic_compare_exchange_n(_slot,&expected,_entry,false,__ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+}
+static long xml_atomic_add( long* _value, long _add )
+{
+  return __atomic_fetch_add(_value,_add,__ATOMIC_ACQ_REL);
+}
+#endif
+
+static void xml_query_cache_free( XmlDocument* _document )
+{
+  XmlQueryCache* cache = _document->cache;
+  if (0==cache) return;
+  for (size_t i=0; i<=cache->mask; ++i) free(cache->slots[i]);
+  free(cache);
+  _document->cache = 0;
+}
+
+static XmlHash xml_query_key( int _kind, XmlElement* _start, const char** _args )
+{
+  XmlHash h = xml_hash_mix((XmlHash)(size_t)_start ^ (XmlHash)_kind);
+  for (int i=0; i<3; ++i) h = xml_hash_string(_args[i],h);
+  return h;
+}
+
+static bool xml_query_matches( const XmlQueryEntry* _entry, XmlHash _key, int _kind, XmlElement* _start, const char** _args )
+{
+  if (_entry->key!=_key || _entry->kind!=_kind || _entry->start!=_start) return false;
+  for (int i=0; i<3; ++i)
+  {
+    if ((_entry->args[i]==0) != (_args[i]==0)) return false;
+    if (_args[i] && 0!=strcmp(_entry->args[i],_args[i])) return false;
+  }
+  return true;
+}
+
+// true if the query was cached, the result (maybe null) is in *_result
+static bool xml_query_lookup( XmlQueryCache* _cache, XmlHash _key, int _kind, XmlElement* _start, const char** _args, XmlElement** _result )
+{
+  for (size_t i=0; i<XML_QUERY_PROBES; ++i)
+  {
+    const XmlQueryEntry* entry = xml_atomic_load(_cache->slots + ((_key+i) & _cache->mask));
+    if (0==entry) return false;
+    if (xml_query_matches(entry,_key,_kind,_start,_args))
+    {
+      *_result = entry->result;
+      return true;
+    }
+  }
+  return false;
+}
+
+static void xml_query_store( XmlQueryCache* _cache, XmlHash _key, int _kind, XmlElement* _start, const char** _args, XmlElement* _result )
+{
+  size_t size[3], bytes = sizeof(XmlQueryEntry);
+  for (int i=0; i<3; ++i)
+  {
+    size[i] = _args[i] ? strlen(_args[i])+1 : 0;
+    bytes += size[i];
+  }
+  XmlQueryEntry* entry = (XmlQueryEntry*) malloc(bytes);
+  if (0==entry) return;
+  entry->key = _key;
+  entry->kind = _kind;
+  entry->start = _start;
+  entry->result = _result;
+  char* str = (char*)(entry+1);
+  for (int i=0; i<3; ++i)
+  {
+    entry->args[i] = _args[i] ? (const char*) memcpy(str,_args[i],size[i]) : 0;
+    str += size[i];
+  }
+  for (size_t i=0; i<XML_QUERY_PROBES; ++i)
+  {
+    XmlQueryEntry** slot = _cache->slots + ((_key+i) & _cache->mask);
+    if (xml_atomic_publish(slot,entry)) return;
+    // another thread may have published the same query meanwhile
+    if (xml_query_matches(xml_atomic_load(slot),_key,_kind,_start,_args)) break;
+  }
+  free(entry);
+}
+
+XML_C_API bool xml_document_freeze( XmlElement* _root, size_t _cacheSize )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_root);
+  if (0==document) return false;
+  if (document->frozen) return true;
+  if (_cacheSize)
+  {
+    size_t slots = 8;
+    while (slots < _cacheSize) slots *= 2;
+    XmlQueryCache* cache = (XmlQueryCache*) calloc(1,sizeof(XmlQueryCache) + slots*sizeof(XmlQueryEntry*));
+    if (0==cache) return false;
+    cache->mask = slots-1;
+    cache->slots = (XmlQueryEntry**)(cache+1);
+    document->cache = cache;
+  }
+  // diff and compare must not write the hashes later
+  if (0==document->root.hash) xml_element_compute_hash(&document->root);
+  document->frozen = true;
+  return true;
+}
+
+XML_C_API bool xml_document_frozen( XmlElement* _elem )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_elem);
+  return document && document->frozen;
+}
+
+XML_C_API void xml_document_retain( XmlElement* _root )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_root);
+  if (document) xml_atomic_add(&document->refs,1);
+}
+
+XML_C_API bool xml_document_release( XmlElement* _root )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_root);
+  if (0==document || 0!=xml_atomic_add(&document->refs,-1)) return false;
+  xml_destroy(&document->root);
+  return true;
+}
+
+XML_C_API XmlElement* xml_element_find_element_by_attribute_value( XmlElement* self, const char* _elemName, const char* _attrName, const char* _attrValue )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(self);
+  XmlQueryCache* cache = document->frozen ? document->cache : 0;
+  if (0==cache) return xml_element_find_by_attribute_value(self,_elemName,_attrName,_attrValue);
+
+  const char* args[3] = { _elemName, _attrName, _attrValue };
+  XmlHash key = xml_query_key(XML_QUERY_ELEMENT_BY_ATTRIBUTE_VALUE,self,args);
+  XmlElement* result = 0;
+  if (!xml_query_lookup(cache,key,XML_QUERY_ELEMENT_BY_ATTRIBUTE_VALUE,self,args,&result))
+  {
+    result = xml_element_find_by_attribute_value(self,_elemName,_attrName,_attrValue);
+    xml_query_store(cache,key,XML_QUERY_ELEMENT_BY_ATTRIBUTE_VALUE,self,args,result);
+  }
+  return result;
+}
+
+// source ranges and incremental reparse
+
+// the root has no room behind its struct, its range is in the document header
+static XmlSourceRange* xml_source_range( XmlElement* _elem )
+{
+  return _elem->parent ? (XmlSourceRange*)(_elem+1) : &((XmlDocument*)_elem)->source;
+}
+
+static ptrdiff_t* xml_source_shifts( XmlSourceRange* _range )
+{
+  return (ptrdiff_t*)(_range->children + _range->count);
+}
+
+static void xml_source_index( XmlScannerContext* _ctx, XmlElement* _elem, size_t _count, bool _scanonly )
+{
+  size_t bytes = _count * (sizeof(XmlElement*) + sizeof(ptrdiff_t));
+  if (_scanonly)
+  {
+    _ctx->nBytes += bytes;
+    return;
+  }
+  XmlSourceRange* range = xml_source_range(_elem);
+  range->children = (XmlElement**) xml_alloc_memory(_ctx,bytes,false);	// no shifts yet
+  if (0==range->children) return;
+  range->count = _count;
+  size_t i = 0;
+  for (XmlElement* iter = _elem->elements; iter && i<_count; iter = iter->next)
+  {
+    if (iter->name) range->children[i++] = iter;
+  }
+}
+
+// sum of the length changes of the children in front of child _index
+static ptrdiff_t xml_source_shift( XmlSourceRange* _range, size_t _index )
+{
+  const ptrdiff_t* shifts = xml_source_shifts(_range);
+  ptrdiff_t shift = 0;
+  for (; _index>0; _index &= _index-1) shift += shifts[_index-1];
+  return shift;
+}
+
+static void xml_source_add_shift( XmlSourceRange* _range, size_t _index, ptrdiff_t _shift )
+{
+  ptrdiff_t* shifts = xml_source_shifts(_range);
+  for (++_index; _index<=_range->count; _index += _index & (0-_index)) shifts[_index-1] += _shift;
+}
+
+// the index of _child in the range of its parent, the offsets are ascending
+static size_t xml_source_ordinal( XmlSourceRange* _parent, XmlElement* _child )
+{
+  size_t offset = xml_source_range(_child)->offset;
+  size_t lo = 0, hi = _parent->count;
+  while (lo+1 < hi)
+  {
+    size_t mid = lo + (hi-lo)/2;
+    if (xml_source_range(_parent->children[mid])->offset <= offset) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// position of child _index, relative to the start of the parent
+static size_t xml_source_start( XmlSourceRange* _parent, size_t _index )
+{
+  return xml_source_range(_parent->children[_index])->offset + (size_t)xml_source_shift(_parent,_index);
+}
+
+XML_C_API bool xml_element_source_range( XmlElement* _elem, size_t* _begin, size_t* _end )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_elem);
+  if (0==document || 0==_elem->name || !(document->flags & XML_PARSE_SOURCE_RANGES)) return false;
+  size_t start = 0;
+  for (XmlElement* e = _elem; e->parent; e = e->parent)
+  {
+    XmlSourceRange* parent = xml_source_range(e->parent);
+    start += xml_source_start(parent,xml_source_ordinal(parent,e));
+  }
+  *_begin = start;
+  *_end = start + xml_source_range(_elem)->length;
+  return true;
+}
+
+static void* xml_heap_alloc( void* _context, size_t _bytes )
+{
+  (void)_context;
+  return malloc(_bytes);
+}
+
+static void xml_heap_free( void* _context, void* _memory, size_t _bytes )
+{
+  (void)_context;
+  (void)_bytes;
+  free(_memory);
+}
+
+XML_C_API XmlElement* xml_reparse_range( XmlElement* _root, const char* _begin, const char* _end, size_t _editBegin, size_t _editEnd, size_t _newSize, XmlErrorHandler _errorHandler, const XmlOptions* _options )
+{
+  XmlDocument* document = (XmlDocument*) xml_element_get_root(_root);
+  if (0==document || !(document->flags & XML_PARSE_SOURCE_RANGES) || document->frozen) return 0;
+  size_t removed = _editEnd - _editBegin;
+  if (_editEnd < _editBegin || _editEnd > document->source.length || (size_t)(_end-_begin) != document->source.length - removed + _newSize)
+  {
+    if (_errorHandler) _errorHandler("the edit doesn't match the document",_begin,_begin);
+    return 0;
+  }
+
+  // descend to the innermost element around the edit: on each level the
+  // last child that starts in front of the edit, if it ends behind it
+  XmlElement* target = 0;
+  size_t index = 0;         // of target among the element children of its parent
+  size_t start = 0;         // position of target
+  XmlElement* parent = &document->root;
+  for (;;)
+  {
+    XmlSourceRange* range = xml_source_range(parent);
+    size_t lo = 0, hi = range->count;
+    while (lo < hi)
+    {
+      size_t mid = lo + (hi-lo)/2;
+      if (start + xml_source_start(range,mid) < _editBegin) lo = mid+1;
+      else hi = mid;
+    }
+    if (0==lo) break;
+    size_t b = start + xml_source_start(range,lo-1);
+    if (_editEnd >= b + xml_source_range(range->children[lo-1])->length) break;
+    target = parent = range->children[lo-1];
+    index = lo-1;
+    start = b;
+  }
+  if (0==target) return 0;
+
+  // scan the new text of target on its own. it sees the namespaces of the
+  // document and the declarations of its ancestors, so the ids don't change.
+  size_t length = xml_source_range(target)->length - removed + _newSize;
+  XmlScannerContext context = {0};
+  if (_options)
+  {
+    context.hints = _options->hints;
+    context.open = _options->open;
+    context.close = _options->close;
+    context.param = _options->param;
+    context.attributeHashWidth = _options->attributeHashWidth;
+  }
+  if (0==context.attributeHashWidth) context.attributeHashWidth = XML_ATTRIBUTE_HASH_WIDTH;
+  context.flags = document->flags;
+  context.errorHandler = _errorHandler;
+  context.begin = _begin + start;
+  context.end = _begin + start + length;
+  context.seedNamespaces = document->namespaces;
+  context.nSeedNamespaces = document->nNamespaces;
+  context.scope = target->parent;
+  for (XmlElement* iter = target->parent; iter; iter = iter->parent)
+  {
+    for (XmlAttribute* attr = iter->attributes; attr; attr = attr->next)
+    {
+      if (0==strncmp(attr->name,"xmlns",5) && (0==attr->name[5] || ':'==attr->name[5])) context.nInherited++;
+    }
+  }
+  static const XmlArena heap = { 0, xml_heap_alloc, xml_heap_free, false };
+  const XmlArena* arena = document->arena.alloc ? &document->arena : &heap;
+  XmlElement* root = xml_document_create(&context,0,arena);
+  XmlDocument* fragment = (XmlDocument*) root;
+  if (0==fragment) return 0;
+
+  // exactly one element that covers all of the new text
+  XmlElement* element = root->elements;
+  if (0==element || element->next || 0==element->name || xml_source_range(element)->length!=length)
+  {
+    if (_errorHandler) _errorHandler("the edit changes the structure around the element",context.begin,context.end);
+    xml_destroy(root);
+    return 0;
+  }
+
+  // splice. only text nodes can be between target and the element child in
+  // front of it. the offset doesn't change, the enclosing elements grow or
+  // shrink and their later siblings move, which is one update of the shifts
+  // per level.
+  parent = target->parent;
+  XmlSourceRange* range = xml_source_range(parent);
+  XmlElement* before = index ? range->children[index-1] : 0;   // the node in front of target
+  if (before==0 && parent->elements!=target) before = parent->elements;
+  while (before && before->next!=target) before = before->next;
+  element->parent = parent;
+  element->next = target->next;
+  if (before) before->next = element;
+  else parent->elements = element;
+  if (parent->tail==target) parent->tail = element;
+  range->children[index] = element;
+  xml_source_range(element)->offset = xml_source_range(target)->offset;
+  ptrdiff_t shift = (ptrdiff_t)_newSize - (ptrdiff_t)removed;
+  for (XmlElement* iter = element; iter->parent; iter = iter->parent)
+  {
+    range = xml_source_range(iter->parent);
+    xml_source_add_shift(range,iter==element ? index : xml_source_ordinal(range,iter),shift);
+    range->length += (size_t)shift;
+  }
+  document->namespaces = fragment->namespaces;
+  document->nNamespaces = fragment->nNamespaces;
+  if (document->flags & XML_PARSE_HASH)
+  {
+    for (XmlElement* iter = parent; iter; iter = iter->parent) xml_element_hash_node(iter,false);
+  }
+  fragment->fragments = document->fragments;
+  document->fragments = fragment;
+  return element;
+}
+
+// streaming tokenizer
+
+typedef struct _XmlStreamBlock XmlStreamBlock;
+
+// memory block of the document mode. the payload follows the header.
+struct _XmlStreamBlock
+{
+  XmlStreamBlock*     next;
+  size_t              size;
+  size_t              used;
+};
+
+struct _XmlStream
+{
+  const XmlStreamHandler* handler;
+  void*               param;
+  XmlErrorHandler     errorHandler;
+  char*               pending;      // incomplete token carried over to the next chunk
+  size_t              nPending;
+  size_t              nPendingCapacity;
+  size_t              scanned;      // the first bytes of the pending token that don't end it
+  char                scanQuote;    // the quote that is open at scanned, start tags only
+  size_t              scanNesting;  // the '<' that are open at scanned, declarations only
+  size_t              depth;
+  bool                failed;
+  void*               extension;    // handler state owned by the stream
+  // document mode
+  unsigned int        flags;        // XML_PARSE_*
+  XmlStreamBlock*     blocks;
+  XmlElement*         pRoot;
+  XmlElement*         pCurrent;
+  bool                unresolved;   // the start tag of pCurrent isn't finished yet
+  const XmlHintTable* hints;
+  XmlForEachFunc      open;
+  XmlForEachFunc      close;
+  void*               callbackParam;
+  size_t              attributeHashWidth;
+  XmlAttribute*       attributes;   // attributes of the open start tag, copied to the blocks as an array
+  size_t              nAttributes;
+  size_t              nAttributesCapacity;
+  XmlNamespaceBinding* bindings;
+  size_t              nBindings;
+  size_t              nBindingsCapacity;
+  size_t              nNamespacesCapacity;
+};
+
+#define XML_STREAM_BLOCK_SIZE (64*1024)
+
+static void xml_stream_dom_text_end( XmlStream* _stream );
+
+// same character set as scan_identifier, but without the '/'
+static bool xml_is_name( const char _ch )
+{
+  return (_ch>='a' && _ch<='z') || (_ch>='A' && _ch<='Z')
+    || (_ch>='0' && _ch<='9') || (_ch=='.') || (_ch==':')
+    || (_ch=='_') || (_ch=='-');
+}
+
+// bounded strstr, the chunks are not zero-terminated
+static const char* xml_find( const char* _begin, const char* _end, const char* _pattern, const size_t _size )
+{
+  while ((size_t)(_end-_begin) >= _size)
+  {
+    const char* p = (const char*) memchr(_begin,_pattern[0],(_end-_begin)-_size+1);
+    if (0==p) return 0;
+    if (0==memcmp(p,_pattern,_size)) return p;
+    _begin = p+1;
+  }
+  return 0;
+}
+
+// true if [_begin,_end) starts with _pattern. *_partial is set if the range is
+// too short to decide but matches so far.
+static bool xml_starts_with( const char* _begin, const char* _end, const char* _pattern, bool* _partial )
+{
+  size_t n = strlen(_pattern);
+  size_t avail = (size_t)(_end-_begin);
+  if (avail < n)
+  {
+    if (0==memcmp(_begin,_pattern,avail)) *_partial = true;
+    return false;
+  }
+  return 0==memcmp(_begin,_pattern,n);
+}
+
+static bool xml_stream_error( XmlStream* _stream, const char* _message, const char* _begin, const char* _current )
+{
+  if (_stream->errorHandler) _stream->errorHandler(_message,_begin,_current);
+  _stream->failed = true;
+  return false;
+}
+
+// parse a complete start tag or processing instruction in [_begin,_end), _begin
+// points behind '<' or '<?' and _end to the closing '>'.
+static bool xml_stream_tag( XmlStream* _stream, const char* _begin, const char* _end, bool _pi )
+{
+  const XmlStreamHandler* h = _stream->handler;
+  const char* tag = _begin;
+  const char* end = _begin;
+  while (end<_end && xml_is_name(*end)) end++;
+  const char* name = _begin;
+  size_t nameSize = end-_begin;
+  bool closed = _pi;
+
+  if (h->element_begin) h->element_begin(_stream->param,name,nameSize);
+
+  _begin = end;
+  while (_begin<_end)
+  {
+    if (xml_is_space(*_begin)) { _begin++; continue; }
+    if ('/'==*_begin || ('?'==*_begin && _pi))
+    {
+      closed = true;
+      _begin++;
+      continue;
+    }
+    end = _begin;
+    while (end<_end && xml_is_name(*end)) end++;
+    if (end==_begin)
+    {
+      _begin++;
+      continue;
+    }
+    const char* attr = _begin;
+    size_t attrSize = end-_begin;
+    const char* value = "";
+    size_t valueSize = 0;
+    _begin = end;
+    while (_begin<_end && xml_is_space(*_begin)) _begin++;
+    if (_begin<_end && '='==*_begin)	// attribute with assignment
+    {
+      _begin++;
+      while (_begin<_end && xml_is_space(*_begin)) _begin++;
+      char quote = _begin<_end ? *_begin : 0;
+      if (quote!='"' && quote!='\'')
+      {
+        return xml_stream_error(_stream,"quoted string (\" or ') expected",tag,_begin);
+      }
+      value = ++_begin;
+      while (_begin<_end && *_begin!=quote) _begin++;
+      valueSize = _begin-value;
+      _begin++;
+    }
+    if (h->attribute) h->attribute(_stream->param,attr,attrSize,value,valueSize);
+  }
+
+  if (closed)
+  {
+    if (h->element_end) h->element_end(_stream->param,name,nameSize);
+  }
+  else
+  {
+    _stream->depth++;
+  }
+  return true;
+}
+
+// report all complete tokens in [_begin,_end) and return the start of the first
+// incomplete one, or 0 on error. if _final is set there is no more input.
+// how far the incomplete token was searched is kept in the stream, with
+// _resume the first token continues there, so a token that spans many
+// chunks is searched once and not again with every chunk.
+static const char* xml_stream_tokenize( XmlStream* _stream, const char* _begin, const char* _end, bool _final, bool _resume )
+{
+  const XmlStreamHandler* h = _stream->handler;
+  size_t scanned = _resume ? _stream->scanned : 0;
+  while (_begin<_end)
+  {
+    size_t searched = 0;    // bytes of an incomplete token that can't contain its end
+    if ('<' != *_begin)
+    {
+      const char* end = (const char*) memchr(_begin+scanned,'<',_end-_begin-scanned);
+      if (0==end)
+      {
+        // trailing text after the last tag is dropped, like xml_document_scan does
+        _stream->scanned = _end-_begin;
+        return _final ? _end : _begin;
+      }
+      if (h->text) h->text(_stream->param,_begin,end-_begin,false);
+      _begin = end;
+      scanned = 0;
+      continue;
+    }
+
+    bool partial = false;
+    const char* end = 0;
+    if (_end-_begin < 2)
+    {
+      partial = true;
+    }
+    else if ('!' == _begin[1])
+    {
+      if (xml_starts_with(_begin,_end,"<![CDATA[",&partial))
+      {
+        // the last two bytes may be the start of "]]>"
+        const char* from = _begin + (scanned>9 ? scanned : 9);
+        end = xml_find(from,_end,"]]>",3);
+        if (end)
+        {
+          if (h->text) h->text(_stream->param,_begin+9,end-_begin-9,true);
+          end += 2;
+        }
+        else if (_final)
+        {
+          xml_stream_error(_stream,"unterminated CDATA",_begin,_end);
+          return 0;
+        }
+        else if (_end-from>2) searched = _end-_begin-2;
+        else searched = from-_begin;
+      }
+      else if (xml_starts_with(_begin,_end,"<!--",&partial))
+      {
+        const char* from = _begin + (scanned>4 ? scanned : 4);
+        end = xml_find(from,_end,"-->",3);
+        if (end) end += 2;
+        else if (_final)
+        {
+          xml_stream_error(_stream,"unterminated comment",_begin,_end);
+          return 0;
+        }
+        else if (_end-from>2) searched = _end-_begin-2;
+        else searched = from-_begin;
+      }
+      else if (!partial || _final)	// skip dtds, doctypes. not supported
+      {
+        size_t nesting = scanned ? _stream->scanNesting : 1;
+        const char* iter = _begin + (scanned ? scanned : 1);
+        partial = false;
+        for (; iter<_end; ++iter)
+        {
+          if ('<' == *iter) nesting++;
+          if ('>' == *iter && 0 == --nesting) break;
+        }
+        if (iter<_end) end = iter;
+        else
+        {
+          searched = _end-_begin;
+          _stream->scanNesting = nesting;
+        }
+      }
+    }
+    else if ('/' == _begin[1])	// this is a terminating element (</name>)
+    {
+      end = (const char*) memchr(_begin+scanned,'>',_end-_begin-scanned);
+      if (end)
+      {
+        const char* name = _begin+2;
+        const char* iter = name;
+        while (iter<end && xml_is_name(*iter)) iter++;
+        if (0 == _stream->depth)
+        {
+          xml_stream_error(_stream,"unexpected end tag",_begin,name);
+          return 0;
+        }
+        _stream->depth--;
+        if (h->element_end) h->element_end(_stream->param,name,iter-name);
+      }
+      else searched = _end-_begin;
+    }
+    else
+    {
+      // find the closing '>', quoted attribute values may contain one
+      char quote = scanned ? _stream->scanQuote : 0;
+      const char* iter = _begin + (scanned ? scanned : 1);
+      for (; iter<_end; ++iter)
+      {
+        if (quote) { if (*iter==quote) quote = 0; }
+        else if ('"'==*iter || '\''==*iter) quote = *iter;
+        else if ('>'==*iter) break;
+      }
+      if (iter<_end)
+      {
+        end = iter;
+        bool pi = ('?' == _begin[1]);
+        if (!xml_stream_tag(_stream,_begin+(pi?2:1),end,pi)) return 0;
+      }
+      else
+      {
+        searched = _end-_begin;
+        _stream->scanQuote = quote;
+      }
+    }
+
+    if (0==end)
+    {
+      if (_final)
+      {
+        xml_stream_error(_stream,"'>' expected",_begin,_end);
+        return 0;
+      }
+      _stream->scanned = searched;
+      return _begin;	// incomplete, wait for more input
+    }
+    if (_stream->failed) return 0;
+    _begin = end+1;
+    scanned = 0;
+  }
+  return _begin;
+}
+
+static bool xml_stream_keep( XmlStream* _stream, const char* _data, size_t _size )
+{
+  if (0==_size) return true;
+  if (_stream->nPending + _size > _stream->nPendingCapacity)
+  {
+    size_t capacity = _stream->nPendingCapacity ? _stream->nPendingCapacity : 4096;
+    while (capacity < _stream->nPending + _size) capacity *= 2;
+    char* pending = (char*) realloc(_stream->pending,capacity);
+    if (0==pending) return xml_stream_error(_stream,"out of memory",_data,_data);
+    _stream->pending = pending;
+    _stream->nPendingCapacity = capacity;
+  }
+  memcpy(_stream->pending+_stream->nPending,_data,_size);
+  _stream->nPending += _size;
+  return true;
+}
+
+XML_C_API bool xml_stream_feed( XmlStream* _stream, const char* _data, size_t _size )
+{
+  if (_stream==0 || _stream->failed) return false;
+  const char* end = _data+_size;
+
+  // complete the carried-over token first. only the bytes up to the next '>'
+  // are copied, the rest of the chunk is tokenized in place.
+  while (_stream->nPending && _data<end)
+  {
+    const char* stop = (const char*) memchr(_data,'>',end-_data);
+    stop = stop ? stop+1 : end;
+    if (!xml_stream_keep(_stream,_data,stop-_data)) return false;
+    _data = stop;
+    const char* rest = xml_stream_tokenize(_stream,_stream->pending,_stream->pending+_stream->nPending,false,true);
+    if (0==rest) return false;
+    if (rest==_stream->pending) continue;	// still incomplete
+    _stream->nPending -= rest-_stream->pending;
+    memmove(_stream->pending,rest,_stream->nPending);
+  }
+
+  if (_data<end)
+  {
+    const char* rest = xml_stream_tokenize(_stream,_data,end,false,false);
+    if (0==rest) return false;
+    return xml_stream_keep(_stream,rest,end-rest);
+  }
+  return true;
+}
+
+XML_C_API bool xml_stream_finish( XmlStream* _stream )
+{
+  if (_stream==0 || _stream->failed) return false;
+  if (_stream->nPending)
+  {
+    if (0==xml_stream_tokenize(_stream,_stream->pending,_stream->pending+_stream->nPending,true,true)) return false;
+    _stream->nPending = 0;
+  }
+  if (_stream->depth)
+  {
+    return xml_stream_error(_stream,"unterminated element",0,0);
+  }
+  if (_stream->pRoot)
+  {
+    xml_stream_dom_text_end(_stream);
+    if (_stream->flags & XML_PARSE_HASH) xml_element_hash_node(_stream->pRoot,false);
+  }
+  return true;
+}
+
+XML_C_API void xml_stream_fail( XmlStream* _stream, const char* _errorMessage )
+{
+  if (_stream) xml_stream_error(_stream,_errorMessage,0,0);
+}
+
+XML_C_API XmlStream* xml_stream_create( const XmlStreamHandler* _handler, void* _param, XmlErrorHandler _errorHandler )
+{
+  if (_handler==0) return 0;
+  XmlStream* stream = (XmlStream*) calloc(1,sizeof(XmlStream));
+  if (stream)
+  {
+    stream->handler = _handler;
+    stream->param = _param;
+    stream->errorHandler = _errorHandler;
+  }
+  return stream;
+}
+
+XML_C_API void xml_stream_destroy( XmlStream* _stream )
+{
+  if (_stream==0) return;
+  if (_stream->pRoot)
+  {
+    free(((XmlDocument*)_stream->pRoot)->namespaces);
+    xml_query_cache_free((XmlDocument*)_stream->pRoot);
+  }
+  while (_stream->blocks)
+  {
+    XmlStreamBlock* next = _stream->blocks->next;
+    free(_stream->blocks);
+    _stream->blocks = next;
+  }
+  free(_stream->bindings);
+  free(_stream->attributes);
+  free(_stream->extension);
+  free(_stream->pending);
+  free(_stream);
+}
+
+// document mode. memory is taken from a chain of blocks, structs are kept pointer-aligned.
+static void* xml_stream_alloc( XmlStream* _stream, size_t _bytes, bool _string )
+{
+  XmlStreamBlock* block = _stream->blocks;
+  if (!_string) _bytes = (_bytes + sizeof(void*)-1) & ~(sizeof(void*)-1);
+  if (block && !_string) block->used = (block->used + sizeof(void*)-1) & ~(sizeof(void*)-1);
+  if (0==block || block->used + _bytes > block->size)
+  {
+    size_t size = _bytes > XML_STREAM_BLOCK_SIZE ? _bytes : XML_STREAM_BLOCK_SIZE;
+    block = (XmlStreamBlock*) malloc(sizeof(XmlStreamBlock)+size);
+    if (0==block)
+    {
+      xml_stream_error(_stream,"out of memory",0,0);
+      return 0;
+    }
+    block->next = _stream->blocks;
+    block->size = size;
+    block->used = 0;
+    _stream->blocks = block;
+  }
+  char* pointer = (char*)(block+1) + block->used;
+  block->used += _bytes;
+  if (!_string) memset(pointer,0,_bytes);
+  return pointer;
+}
+
+static char* xml_stream_clone_string( XmlStream* _stream, const char* _str, size_t _size, bool _escape )
+{
+  char* str = (char*) xml_stream_alloc(_stream,_size+1,true);
+  if (str)
+  {
+    str[xml_unescape(str,_str,_size,_escape)]=0;
+  }
+  return str;
+}
+
+// append to the text node of a coalesced run. it grows in place as long as
+// the run is the last allocation of the current block.
+static void xml_stream_append_text( XmlStream* _stream, XmlElement* _text, const char* _str, size_t _size, bool _escape )
+{
+  XmlStreamBlock* block = _stream->blocks;
+  char* str = (char*) _text->content;
+  size_t n = strlen(str);
+  if (str+n+1 == (char*)(block+1) + block->used && block->used + _size <= block->size)
+  {
+    block->used += _size;
+  }
+  else
+  {
+    char* copy = (char*) xml_stream_alloc(_stream,n+_size+1,true);
+    if (copy==0) return;
+    memcpy(copy,str,n);
+    _text->content = str = copy;
+  }
+  str[n+xml_unescape(str+n,_str,_size,_escape)] = 0;
+}
+
+// the current text run of the open element is complete
+static void xml_stream_dom_text_end( XmlStream* _stream )
+{
+  const unsigned int mask = XML_PARSE_TRIM_TEXT|XML_PARSE_COALESCE_TEXT;
+  XmlElement* tail = _stream->pCurrent ? _stream->pCurrent->tail : 0;
+  if (tail && 0==tail->name && mask==(_stream->flags & mask)) xml_text_trim(tail);
+}
+
+// the start tag of the open element is complete (the handler doesn't tell,
+// so this runs on the next event). the tables grow here, the stream can't
+// count the declarations in advance.
+static void xml_stream_dom_resolve( XmlStream* _stream )
+{
+  if (!_stream->unresolved || _stream->failed) return;
+  _stream->unresolved = false;
+  XmlDocument* document = (XmlDocument*) _stream->pRoot;
+  XmlElement* element = _stream->pCurrent;
+  size_t n = _stream->nAttributes;
+  if (n)
+  {
+    XmlAttribute* attributes = (XmlAttribute*) xml_stream_alloc(_stream,n*sizeof(XmlAttribute),false);
+    if (0==attributes) return;
+    for (size_t i=0; i<n; ++i)
+    {
+      attributes[i] = _stream->attributes[i];
+      xml_element_add_attribute(element,attributes+i);
+    }
+    _stream->nAttributes = 0;
+    if (n > _stream->attributeHashWidth)
+    {
+      unsigned int* index = (unsigned int*) xml_stream_alloc(_stream,xml_attribute_index_size(n),false);
+      if (0==index) return;
+      xml_attribute_index_build(element,index);
+    }
+  }
+  if (_stream->nBindings + n > _stream->nBindingsCapacity)
+  {
+    size_t capacity = 2*(_stream->nBindings + n);
+    XmlNamespaceBinding* bindings = (XmlNamespaceBinding*) realloc(_stream->bindings,capacity*sizeof(XmlNamespaceBinding));
+    if (0==bindings)
+    {
+      xml_stream_error(_stream,"out of memory",0,0);
+      return;
+    }
+    _stream->bindings = bindings;
+    _stream->nBindingsCapacity = capacity;
+  }
+  if (document->nNamespaces + n + 2 > _stream->nNamespacesCapacity)
+  {
+    size_t capacity = 2*(document->nNamespaces + n + 2);
+    const char** namespaces = (const char**) realloc(document->namespaces,capacity*sizeof(const char*));
+    if (0==namespaces)
+    {
+      xml_stream_error(_stream,"out of memory",0,0);
+      return;
+    }
+    document->namespaces = namespaces;
+    _stream->nNamespacesCapacity = capacity;
+  }
+  xml_namespace_resolve(document,_stream->bindings,&_stream->nBindings,element);
+  if (_stream->open) _stream->open(element,_stream->callbackParam);
+}
+
+static void xml_stream_dom_begin( void* _param, const char* _name, size_t _size )
+{
+  XmlStream* stream = (XmlStream*) _param;
+  xml_stream_dom_resolve(stream);
+  size_t hintSize = xml_hint_size(stream->hints,_name,_size);
+  XmlElement* element = (XmlElement*) xml_stream_alloc(stream,sizeof(XmlElement)+hintSize,false);
+  if (element==0) return;
+  element->name = xml_stream_clone_string(stream,_name,_size,true);
+  element->localName = xml_local_name(element->name);
+  if (hintSize) element->userdata = element+1;
+  xml_stream_dom_text_end(stream);
+  xml_element_add_element(stream->pCurrent,element);
+  stream->pCurrent = element;
+  stream->unresolved = true;
+}
+
+static void xml_stream_dom_attribute( void* _param, const char* _name, size_t _nameSize, const char* _value, size_t _valueSize )
+{
+  XmlStream* stream = (XmlStream*) _param;
+  if (stream->failed) return;
+  if (stream->nAttributes == stream->nAttributesCapacity)
+  {
+    size_t capacity = stream->nAttributesCapacity ? 2*stream->nAttributesCapacity : 16;
+    XmlAttribute* attributes = (XmlAttribute*) realloc(stream->attributes,capacity*sizeof(XmlAttribute));
+    if (0==attributes)
+    {
+      xml_stream_error(stream,"out of memory",0,0);
+      return;
+    }
+    stream->attributes = attributes;
+    stream->nAttributesCapacity = capacity;
+  }
+  XmlAttribute* attribute = stream->attributes + stream->nAttributes++;
+  memset(attribute,0,sizeof(XmlAttribute));
+  attribute->name = xml_stream_clone_string(stream,_name,_nameSize,true);
+  attribute->localName = xml_local_name(attribute->name);
+  attribute->content = _valueSize ? xml_stream_clone_string(stream,_value,_valueSize,true) : "";
+}
+
+static void xml_stream_dom_end( void* _param, const char* _name, size_t _size )
+{
+  XmlStream* stream = (XmlStream*) _param;
+  (void)_name;
+  (void)_size;
+  xml_stream_dom_resolve(stream);
+  xml_stream_dom_text_end(stream);
+  if (stream->flags & XML_PARSE_HASH) xml_element_hash_node(stream->pCurrent,false);
+  if (stream->close && stream->pCurrent->parent) stream->close(stream->pCurrent,stream->callbackParam);
+  xml_namespace_pop(stream->bindings,&stream->nBindings,stream->pCurrent);
+  if (stream->pCurrent->parent) stream->pCurrent = stream->pCurrent->parent;
+}
+
+static void xml_stream_dom_text( void* _param, const char* _text, size_t _size, bool _cdata )
+{
+  XmlStream* stream = (XmlStream*) _param;
+  const unsigned int flags = stream->flags;
+  if (stream->failed) return;
+  xml_stream_dom_resolve(stream);
+  if (!_cdata && (flags & XML_PARSE_SKIP_WHITESPACE) && xml_is_blank(_text,_text+_size)) return;
+
+  // same rules as xml_document_text
+  XmlElement* tail = stream->pCurrent->tail;
+  bool merge = tail && 0==tail->name && (flags & XML_PARSE_COALESCE_TEXT);
+  if (flags & XML_PARSE_TRIM_TEXT)
+  {
+    if (!merge) while (_size && xml_is_space(*_text)) { _text++; _size--; }
+    if (!(flags & XML_PARSE_COALESCE_TEXT)) while (_size && xml_is_space(_text[_size-1])) _size--;
+    if (!merge && 0==_size) return;
+  }
+  if (merge)
+  {
+    xml_stream_append_text(stream,tail,_text,_size,!_cdata);
+    stream->pCurrent->content = tail->content;
+    return;
+  }
+
+  XmlElement* text = (XmlElement*) xml_stream_alloc(stream,sizeof(XmlElement),false);
+  if (text==0) return;
+  text->content = xml_stream_clone_string(stream,_text,_size,!_cdata);
+
+  // convenience
+  stream->pCurrent->content = text->content;
+
+  xml_element_add_element(stream->pCurrent,text);
+}
+
+static const XmlStreamHandler xml_stream_dom_handler =
+{
+  xml_stream_dom_begin,
+  xml_stream_dom_attribute,
+  xml_stream_dom_end,
+  xml_stream_dom_text
+};
+
+XML_C_API XmlStream* xml_stream_create_document( XmlErrorHandler _errorHandler, const XmlOptions* _options )
+{
+  XmlStream* stream = xml_stream_create(&xml_stream_dom_handler,0,_errorHandler);
+  if (stream)
+  {
+    stream->param = stream;
+    if (_options)
+    {
+      stream->flags = _options->flags;
+      stream->hints = _options->hints;
+      stream->open = _options->open;
+      stream->close = _options->close;
+      stream->callbackParam = _options->param;
+      stream->attributeHashWidth = _options->attributeHashWidth;
+    }
+    if (0==stream->attributeHashWidth) stream->attributeHashWidth = XML_ATTRIBUTE_HASH_WIDTH;
+    // the header has no arena, xml_destroy leaves the blocks to the stream
+    stream->pRoot = (XmlElement*) xml_stream_alloc(stream,sizeof(XmlDocument),false);
+    if (stream->pRoot==0)
+    {
+      xml_stream_destroy(stream);
+      return 0;
+    }
+    stream->pRoot->name = "";
+    stream->pRoot->localName = "";
+    stream->pRoot->content = "";
+    stream->pCurrent = stream->pRoot;
+  }
+  return stream;
+}
+
+XML_C_API XmlElement* xml_stream_document( XmlStream* _stream )
+{
+  return (_stream && !_stream->failed) ? _stream->pRoot : 0;
+}
+
+// well-formedness validation
+
+// character classes for names: 1 = name start char, 2 = name char
+static const unsigned char xml_name_class[256] =
+{
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,2,2,0,2,2,2,2,2,2,2,2,2,2,3,0,0,0,0,0,
+  0,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,0,0,0,0,3,
+  0,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,0,0,0,0,0,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3
+};
+
+static bool xml_is_name_start( const char _ch )
+{
+  return 0 != (xml_name_class[(unsigned char)_ch] & 1);
+}
+
+static bool xml_is_name_char( const char _ch )
+{
+  return 0 != (xml_name_class[(unsigned char)_ch] & 2);
+}
+
+// returns the end of the name at _begin, or _begin if there is none
+static const char* xml_validate_name( const char* _begin, const char* _end )
+{
+  if (_begin<_end && xml_is_name_start(*_begin))
+  {
+    for (++_begin; _begin<_end && xml_is_name_char(*_begin); ++_begin);
+  }
+  return _begin;
+}
+
+// _begin points to '&'. returns the position behind the ';' or 0
+static const char* xml_validate_reference( const char* _begin, const char* _end )
+{
+  const char* iter = _begin+1;
+  if (iter<_end && '#'==*iter)
+  {
+    const char* digits;
+    bool hex = (++iter<_end && 'x'==*iter);
+    if (hex) ++iter;
+    for (digits = iter; iter<_end; ++iter)
+    {
+      char c = *iter;
+      if ((c>='0' && c<='9') || (hex && ((c>='a' && c<='f') || (c>='A' && c<='F')))) continue;
+      break;
+    }
+    if (iter==digits) return 0;
+  }
+  else
+  {
+    const char* name = iter;
+    iter = xml_validate_name(name,_end);
+    if (iter==name) return 0;
+  }
+  return (iter<_end && ';'==*iter) ? iter+1 : 0;
+}
+
+static const char* xml_skip_space( const char* _begin, const char* _end )
+{
+  while (_begin<_end && xml_is_space(*_begin)) _begin++;
+  return _begin;
+}
+
+// behind the value of an attribute, [_nameEnd,_limit) is valid already
+static const char* xml_validate_skip_value( const char* _nameEnd, const char* _limit )
+{
+  const char* value = xml_skip_space(xml_skip_space(_nameEnd,_limit)+1,_limit);   // behind '='
+  return (const char*) memchr(value+1,*value,_limit-value-1) + 1;
+}
+
+// Unique Att Spec: compare the attribute name [_name,_nameEnd) with the names
+// of the attributes before it, which start at _first and are valid already
+static bool xml_validate_rescan( const char* _first, const char* _name, const char* _nameEnd )
+{
+  size_t size = _nameEnd-_name;
+  for (;;)
+  {
+    const char* name = xml_skip_space(_first,_name);
+    if (name==_name) return true;
+    const char* end = xml_validate_name(name,_name);
+    if ((size_t)(end-name)==size && 0==memcmp(name,_name,size)) return false;
+    _first = xml_validate_skip_value(end,_name);
+  }
+}
+
+// the names of a wide tag in an open addressing table, as offsets from the
+// start of the attributes. at most half of the slots are used.
+#define XML_VALIDATE_SLOTS (2*XML_VALIDATE_ATTRIBUTES)
+
+typedef struct _XmlValidateNames XmlValidateNames;
+
+struct _XmlValidateNames
+{
+  const char*         first;      // where the attributes of the tag start
+  const char*         overflow;   // the first name that is not in the table
+  size_t              count;      // attributes seen so far
+  unsigned int        slots[XML_VALIDATE_SLOTS];  // offset+1, 0 if free
+};
+
+// false if the name is in the table already. otherwise it is added if _insert is set
+static bool xml_validate_insert( XmlValidateNames* _names, const char* _name, const char* _nameEnd, bool _insert )
+{
+  size_t size = _nameEnd-_name;
+  size_t h = xml_hint_hash(_name,size) & (XML_VALIDATE_SLOTS-1);
+  for (; _names->slots[h]; h = (h+1) & (XML_VALIDATE_SLOTS-1))
+  {
+    const char* name = _names->first + _names->slots[h]-1;
+    if ((size_t)(xml_validate_name(name,_nameEnd)-name)==size && 0==memcmp(name,_name,size)) return false;
+  }
+  if (_insert) _names->slots[h] = (unsigned int)(_name-_names->first) + 1;
+  return true;
+}
+
+// narrow tags are rescanned. a tag gets the table with its
+// XML_ATTRIBUTE_HASH_WIDTH+1st attribute, then every name is one probe. the
+// names behind a full table are compared with each other one by one.
+static bool xml_validate_unique( XmlValidateNames* _names, const char* _name, const char* _nameEnd )
+{
+  size_t i = _names->count++;
+  if (i < XML_ATTRIBUTE_HASH_WIDTH) return xml_validate_rescan(_names->first,_name,_nameEnd);
+  if (i == XML_ATTRIBUTE_HASH_WIDTH)
+  {
+    memset(_names->slots,0,sizeof(_names->slots));
+    _names->overflow = 0;
+    for (const char* name = xml_skip_space(_names->first,_name); name!=_name; name = xml_skip_space(name,_name))
+    {
+      const char* end = xml_validate_name(name,_name);
+      xml_validate_insert(_names,name,end,true);
+      name = xml_validate_skip_value(end,_name);
+    }
+  }
+  if (0==_names->overflow && (i == XML_VALIDATE_ATTRIBUTES || (size_t)(_name-_names->first) >= 0xffffffffu)) _names->overflow = _name;
+  if (0==_names->overflow) return xml_validate_insert(_names,_name,_nameEnd,true);
+  return xml_validate_insert(_names,_name,_nameEnd,false) && xml_validate_rescan(_names->overflow,_name,_nameEnd);
+}
+
+XML_C_API void xml_error_location( const char* _begin, const char* _current, size_t* _line, size_t* _column )
+{
+  size_t line = 1;
+  const char* start = _begin;
+  const char* iter;
+  while (_begin<_current && 0!=(iter = (const char*) memchr(_begin,'\n',_current-_begin)))
+  {
+    line++;
+    start = _begin = iter+1;
+  }
+  if (_line) *_line = line;
+  if (_column) *_column = (size_t)(_current-start) + 1;
+}
+
+XML_C_API bool xml_validate( const char* _begin, const char* _end, XmlValidationError* _error )
+{
+  const char* names[XML_VALIDATE_DEPTH];
+  size_t sizes[XML_VALIDATE_DEPTH];
+  XmlValidateNames attributes;
+  size_t depth = 0;
+  bool root = false;      // the root element was opened
+  const char* message = 0;
+  const char* iter = _begin;
+
+  if (_end-iter>=3 && 0==memcmp(iter,"\xEF\xBB\xBF",3)) iter += 3;	// UTF-8 BOM
+
+  while (iter<_end && 0==message)
+  {
+    if ('<' != *iter)
+    {
+      if (0==depth)
+      {
+        if (!xml_is_space(*iter)) message = "text outside of the root element";
+        else iter++;
+        continue;
+      }
+      const char* text = iter;
+      while (iter<_end && '<'!=*iter && '&'!=*iter && '>'!=*iter) iter++;
+      if (iter==_end) break;
+      if ('&'==*iter)
+      {
+        const char* next = xml_validate_reference(iter,_end);
+        if (next) iter = next;
+        else message = "invalid entity reference";
+      }
+      else if ('>'==*iter)
+      {
+        if (iter-text>=2 && ']'==iter[-1] && ']'==iter[-2]) { iter -= 2; message = "']]>' is not allowed in text"; }
+        else iter++;
+      }
+      continue;
+    }
+
+    if (_end-iter<2)
+    {
+      message = "unexpected end of document";
+    }
+    else if ('!' == iter[1])
+    {
+      bool partial = false;
+      if (xml_starts_with(iter,_end,"<!--",&partial))
+      {
+        const char* end = xml_find(iter+4,_end,"--",2);
+        if (0==end) message = "unterminated comment";
+        else if (end+2<_end && '>'==end[2]) iter = end+3;
+        else { iter = end; message = "'--' is not allowed in comments"; }
+      }
+      else if (xml_starts_with(iter,_end,"<![CDATA[",&partial))
+      {
+        const char* end = xml_find(iter+9,_end,"]]>",3);
+        if (0==depth) message = "CDATA outside of the root element";
+        else if (0==end) message = "unterminated CDATA";
+        else iter = end+3;
+      }
+      else if (xml_starts_with(iter,_end,"<!DOCTYPE",&partial))
+      {
+        // skip the internal subset, brackets and quotes may contain '>'
+        const char* end = iter+9;
+        int brackets = 0;
+        char quote = 0;
+        for (; end<_end; ++end)
+        {
+          if (quote) { if (*end==quote) quote = 0; }
+          else if ('"'==*end || '\''==*end) quote = *end;
+          else if ('['==*end) brackets++;
+          else if (']'==*end) brackets--;
+          else if ('>'==*end && brackets<=0) break;
+        }
+        if (root) message = "DOCTYPE after the root element";
+        else if (end==_end) message = "unterminated DOCTYPE";
+        else iter = end+1;
+      }
+      else
+      {
+        message = "invalid markup declaration";
+      }
+    }
+    else if ('?' == iter[1])
+    {
+      const char* name = xml_validate_name(iter+2,_end);
+      const char* end = xml_find(name,_end,"?>",2);
+      if (name==iter+2) message = "processing instruction target expected";
+      else if (0==end) message = "unterminated processing instruction";
+      else iter = end+2;
+    }
+    else if ('/' == iter[1])	// end tag
+    {
+      const char* name = iter+2;
+      const char* end = xml_validate_name(name,_end);
+      if (0==depth)
+      {
+        message = "unexpected end tag";
+      }
+      else if ((size_t)(end-name)!=sizes[depth-1] || 0!=memcmp(name,names[depth-1],sizes[depth-1]))
+      {
+        iter = name;
+        message = "end tag does not match the start tag";
+      }
+      else
+      {
+        end = xml_skip_space(end,_end);
+        if (end<_end && '>'==*end)
+        {
+          depth--;
+          iter = end+1;
+        }
+        else
+        {
+          iter = end;
+          message = "'>' expected";
+        }
+      }
+    }
+    else	// start tag
+    {
+      const char* name = iter+1;
+      const char* end = xml_validate_name(name,_end);
+      if (root && 0==depth) { message = "more than one root element"; continue; }
+      if (end==name) { iter = name; message = "element name expected"; continue; }
+      if (XML_VALIDATE_DEPTH==depth) { message = "elements nested too deeply"; continue; }
+      names[depth] = name;
+      sizes[depth] = end-name;
+      depth++;
+      root = true;
+
+      // attributes
+      attributes.first = end;
+      attributes.count = 0;
+      iter = end;
+      for (;;)
+      {
+        const char* attr = xml_skip_space(iter,_end);
+        if (attr==_end) { iter = attr; message = "unterminated tag"; break; }
+        if ('>'==*attr) { iter = attr+1; break; }
+        if ('/'==*attr)
+        {
+          if (attr+1<_end && '>'==attr[1]) { depth--; iter = attr+2; }
+          else { iter = attr; message = "'>' expected"; }
+          break;
+        }
+        if (attr==iter) { message = "whitespace expected"; break; }
+        end = xml_validate_name(attr,_end);
+        if (end==attr) { iter = attr; message = "attribute name expected"; break; }
+        if (!xml_validate_unique(&attributes,attr,end)) { iter = attr; message = "duplicate attribute"; break; }
+        iter = xml_skip_space(end,_end);
+        if (iter==_end || '='!=*iter) { message = "'=' expected"; break; }
+        iter = xml_skip_space(iter+1,_end);
+        if (iter==_end || ('"'!=*iter && '\''!=*iter)) { message = "quoted string (\" or ') expected"; break; }
+        char quote = *iter++;
+        while (iter<_end && quote!=*iter)
+        {
+          if ('<'==*iter) { message = "'<' is not allowed in attribute values"; break; }
+          if ('&'==*iter)
+          {
+            const char* next = xml_validate_reference(iter,_end);
+            if (0==next) { message = "invalid entity reference"; break; }
+            iter = next;
+          }
+          else iter++;
+        }
+        if (message) break;
+        if (iter==_end) { message = "unterminated attribute value"; break; }
+        iter++;
+      }
+    }
+  }
+
+  if (0==message)
+  {
+    if (depth) message = "unterminated element";
+    else if (!root) message = "no root element";
+  }
+  if (message && _error)
+  {
+    // only now it is worth counting lines
+    _error->message = message;
+    _error->offset = (size_t)(iter-_begin);
+    xml_error_location(_begin,iter,&_error->line,&_error->column);
+  }
+  return 0==message;
+}
+
+// columnar record extraction
+
+// state of xml_stream_create_columns
+typedef struct _XmlColumnReader XmlColumnReader;
+struct _XmlColumnReader
+{
+  XmlStream*          stream;
+  const char*         record;
+  XmlColumn*          columns;
+  size_t              count;
+  size_t              depth;
+  size_t              recordDepth;  // 0 if no record is open
+};
+
+static bool xml_column_grow( void** _buffer, size_t* _capacity, size_t _needed )
+{
+  if (_needed <= *_capacity) return true;
+  size_t capacity = *_capacity ? *_capacity : 64;
+  while (capacity < _needed) capacity *= 2;
+  void* buffer = realloc(*_buffer,capacity);
+  if (0==buffer) return false;
+  *_buffer = buffer;
+  *_capacity = capacity;
+  return true;
+}
+
+// append text to the value of the current row
+static bool xml_column_append( XmlColumn* _column, const char* _text, size_t _size, bool _escape )
+{
+  if (XML_COLUMN_STRING==_column->type)
+  {
+    if (!xml_column_grow(&_column->values,&_column->valuesCapacity,_column->valuesSize+_size)) return false;
+    _column->valuesSize += xml_unescape((char*)_column->values+_column->valuesSize,_text,_size,_escape);
+  }
+  else
+  {
+    if (!xml_column_grow((void**)&_column->scratch,&_column->scratchCapacity,_column->scratchSize+_size+1)) return false;
+    _column->scratchSize += xml_unescape(_column->scratch+_column->scratchSize,_text,_size,_escape);
+  }
+  return true;
+}
+
+// numbers are parsed when the row is complete, all of the text has to be the number
+static bool xml_column_parse( XmlColumn* _column, void* _value )
+{
+  char* str = _column->scratch;
+  char* end = str;
+  if (0==str) return false;
+  str[_column->scratchSize] = 0;
+  if (XML_COLUMN_INT64==_column->type) *(long long*)_value = strtoll(str,&end,10);
+  else *(double*)_value = strtod(str,&end);
+  if (end==str) return false;
+  while (xml_is_space(*end)) end++;
+  return 0==*end;
+}
+
+static bool xml_column_end_row( XmlColumn* _column )
+{
+  size_t row = _column->length;
+  bool valid = _column->matched;
+  if (!xml_column_grow((void**)&_column->validity,&_column->validityCapacity,row/8+1)) return false;
+  if (XML_COLUMN_STRING==_column->type)
+  {
+    if (!xml_column_grow((void**)&_column->offsets,&_column->offsetsCapacity,(row+2)*sizeof(long long))) return false;
+    _column->offsets[0] = 0;
+    _column->offsets[row+1] = (long long) _column->valuesSize;
+  }
+  else
+  {
+    size_t size = XML_COLUMN_INT64==_column->type ? sizeof(long long) : sizeof(double);
+    if (!xml_column_grow(&_column->values,&_column->valuesCapacity,(row+1)*size)) return false;
+    char* value = (char*)_column->values + row*size;
+    if (valid) valid = xml_column_parse(_column,value);
+    if (!valid) memset(value,0,size);
+    _column->valuesSize = (row+1)*size;
+  }
+  if (0==(row&7)) _column->validity[row/8] = 0;
+  if (valid) _column->validity[row/8] |= (unsigned char)(1<<(row&7));
+  else _column->nullCount++;
+  _column->length++;
+  _column->matched = false;
+  _column->capturing = false;
+  _column->scratchSize = 0;
+  return true;
+}
+
+static bool xml_columns_record( XmlElement* _record, XmlColumn* _columns, size_t _count )
+{
+  size_t i;
+  for (XmlAttribute* attr = _record->attributes; attr; attr = attr->next)
+  {
+    for (i=0; i<_count; ++i)
+    {
+      XmlColumn* column = _columns+i;
+      if (column->attribute && !column->matched && xml_attribute_name(attr,column->attribute))
+      {
+        column->matched = true;
+        if (!xml_column_append(column,attr->content,strlen(attr->content),false)) return false;
+      }
+    }
+  }
+  for (XmlElement* child = _record->elements; child; child = child->next)
+  {
+    if (0==child->name) continue;
+    for (i=0; i<_count; ++i)
+    {
+      XmlColumn* column = _columns+i;
+      if (column->element && !column->matched && xml_element_name(child,column->element))
+      {
+        column->matched = true;
+        for (XmlElement* text = child->elements; text; text = text->next)
+        {
+          if (0==text->name && !xml_column_append(column,text->content,strlen(text->content),false)) return false;
+        }
+      }
+    }
+  }
+  for (i=0; i<_count; ++i)
+  {
+    if (!xml_column_end_row(_columns+i)) return false;
+  }
+  return true;
+}
+
+// the offsets of a string column start with a 0, even if there are no rows
+static bool xml_columns_begin( XmlColumn* _columns, size_t _count )
+{
+  for (size_t i=0; i<_count; ++i)
+  {
+    XmlColumn* column = _columns+i;
+    if (XML_COLUMN_STRING==column->type && 0==column->offsets)
+    {
+      if (!xml_column_grow((void**)&column->offsets,&column->offsetsCapacity,sizeof(long long))) return false;
+      column->offsets[0] = 0;
+    }
+  }
+  return true;
+}
+
+static bool xml_columns_extract( XmlElement* _elem, const char* _record, XmlColumn* _columns, size_t _count )
+{
+  if (xml_element_name(_elem,_record)) return xml_columns_record(_elem,_columns,_count);
+
+  for (XmlElement* iter = _elem->elements; iter; iter = iter->next)
+  {
+    if (!xml_columns_extract(iter,_record,_columns,_count)) return false;
+  }
+  return true;
+}
+
+XML_C_API bool xml_element_extract_columns( XmlElement* _elem, const char* _record, XmlColumn* _columns, size_t _count )
+{
+  return xml_columns_begin(_columns,_count) && xml_columns_extract(_elem,_record,_columns,_count);
+}
+
+// xml_name_match for the names of the stream, they are not zero-terminated
+static bool xml_column_name( const char* _name, size_t _size, const char* _value )
+{
+  if (0==strchr(_value,':'))
+  {
+    const char* colon = (const char*) memchr(_name,':',_size);
+    if (colon)
+    {
+      _size -= (colon+1)-_name;
+      _name = colon+1;
+    }
+  }
+  return strlen(_value)==_size && 0==memcmp(_name,_value,_size);
+}
+
+static void xml_column_reader_begin( void* _param, const char* _name, size_t _size )
+{
+  XmlColumnReader* reader = (XmlColumnReader*) _param;
+  reader->depth++;
+  if (0==reader->recordDepth)
+  {
+    if (xml_column_name(_name,_size,reader->record)) reader->recordDepth = reader->depth;
+  }
+  else if (reader->depth==reader->recordDepth+1)
+  {
+    for (size_t i=0; i<reader->count; ++i)
+    {
+      XmlColumn* column = reader->columns+i;
+      if (column->element && !column->matched && xml_column_name(_name,_size,column->element))
+      {
+        column->matched = true;
+        column->capturing = true;
+      }
+    }
+  }
+}
+
+static void xml_column_reader_attribute( void* _param, const char* _name, size_t _nameSize, const char* _value, size_t _valueSize )
+{
+  XmlColumnReader* reader = (XmlColumnReader*) _param;
+  if (0==reader->recordDepth || reader->depth!=reader->recordDepth) return;
+  for (size_t i=0; i<reader->count; ++i)
+  {
+    XmlColumn* column = reader->columns+i;
+    if (column->attribute && !column->matched && xml_column_name(_name,_nameSize,column->attribute))
+    {
+      column->matched = true;
+      if (!xml_column_append(column,_value,_valueSize,true)) xml_stream_error(reader->stream,"out of memory",0,0);
+    }
+  }
+}
+
+static void xml_column_reader_end( void* _param, const char* _name, size_t _size )
+{
+  XmlColumnReader* reader = (XmlColumnReader*) _param;
+  (void)_name;
+  (void)_size;
+  if (reader->recordDepth && reader->depth==reader->recordDepth+1)
+  {
+    for (size_t i=0; i<reader->count; ++i) reader->columns[i].capturing = false;
+  }
+  else if (reader->recordDepth && reader->depth==reader->recordDepth)
+  {
+    for (size_t i=0; i<reader->count; ++i)
+    {
+      if (!xml_column_end_row(reader->columns+i)) xml_stream_error(reader->stream,"out of memory",0,0);
+    }
+    reader->recordDepth = 0;
+  }
+  if (reader->depth) reader->depth--;
+}
+
+static void xml_column_reader_text( void* _param, const char* _text, size_t _size, bool _cdata )
+{
+  XmlColumnReader* reader = (XmlColumnReader*) _param;
+  if (0==reader->recordDepth || reader->depth!=reader->recordDepth+1) return;
+  for (size_t i=0; i<reader->count; ++i)
+  {
+    XmlColumn* column = reader->columns+i;
+    if (column->capturing && !xml_column_append(column,_text,_size,!_cdata)) xml_stream_error(reader->stream,"out of memory",0,0);
+  }
+}
+
+static const XmlStreamHandler xml_column_reader_handler =
+{
+  xml_column_reader_begin,
+  xml_column_reader_attribute,
+  xml_column_reader_end,
+  xml_column_reader_text
+};
+
+XML_C_API XmlStream* xml_stream_create_columns( const char* _record, XmlColumn* _columns, size_t _count, XmlErrorHandler _errorHandler )
+{
+  if (_record==0 || !xml_columns_begin(_columns,_count)) return 0;
+  XmlColumnReader* reader = (XmlColumnReader*) calloc(1,sizeof(XmlColumnReader));
+  if (reader==0) return 0;
+  XmlStream* stream = xml_stream_create(&xml_column_reader_handler,reader,_errorHandler);
+  if (stream==0)
+  {
+    free(reader);
+    return 0;
+  }
+  stream->extension = reader;
+  reader->stream = stream;
+  reader->record = _record;
+  reader->columns = _columns;
+  reader->count = _count;
+  return stream;
+}
+
+XML_C_API void xml_columns_free( XmlColumn* _columns, size_t _count )
+{
+  for (size_t i=0; i<_count; ++i)
+  {
+    XmlColumn* column = _columns+i;
+    free(column->validity);
+    free(column->offsets);
+    free(column->values);
+    free(column->scratch);
+    column->validity = 0;
+    column->offsets = 0;
+    column->values = 0;
+    column->scratch = 0;
+    column->length = column->nullCount = column->valuesSize = 0;
+    column->validityCapacity = column->offsetsCapacity = column->valuesCapacity = 0;
+    column->scratchSize = column->scratchCapacity = 0;
+    column->matched = column->capturing = false;
+  }
 }
 
 // vim:ts=2
@@ -56,9 +56,11 @@
 #	define XML_C_API
 #endif
 
+typedef unsigned long long XmlHash;
 typedef struct _XmlAttribute XmlAttribute;
 typedef struct _XmlElement   XmlElement;
 typedef struct _XmlSizeofHint XmlSizeofHint;
+typedef struct _XmlHintTable XmlHintTable;
 
 struct _XmlSizeofHint
 {
@@ -73,6 +75,8 @@ struct _XmlAttribute
   const char*   name;
   const char*   content;
   XmlAttribute*	next;
+  const char*   localName;    // name without the prefix
+  unsigned int  nsId;         // namespace of the name, 0 if none
 };
 
 // Xml element holds a link to its parent element, a list of its children elements
@@ -86,13 +90,30 @@ struct _XmlElement
   XmlElement*		parent;				// link to parent or null if root element
   XmlElement*		elements;			// children elements (or null if no children)
   XmlAttribute*	attributes;		// element attributes (or null...)
-  void*         userdata;			// C-like userdata.
+  void*         userdata;			// C-like userdata. points to the reserved bytes if a size hint matched
+  XmlHash       hash;         // structural hash of the subtree, 0 if not computed
+  const char*   localName;    // name without the prefix
+  unsigned int  nsId;         // namespace of the name, 0 if none
+  size_t        attributeCount;   // attributes is an array of this many entries, next links them as well
+  const unsigned int* attributeIndex; // hash of the attribute names of wide elements, or null
 };
 
 // error handler
 typedef void(*XmlErrorHandler)(const char* _errorMessage, const char* _begin, const char* _current );
 typedef void*(*XmlAllocator)(size_t _bytes);
 
+// allocator with context and a matching free. if the memory comes back
+// zero-filled (calloc, anonymous mappings), set zeroed and the parser won't
+// clear it again.
+typedef struct _XmlArena XmlArena;
+struct _XmlArena
+{
+  void*   context;
+  void*   (*alloc)( void* _context, size_t _bytes );
+  void    (*free)( void* _context, void* _memory, size_t _bytes );
+  bool    zeroed;
+};
+
 // simple string compare. the idea is to have a compare function that supports quoted and unquoted entities (i.e. compare("&gt;",">") == true)
 XML_C_API bool xml_compare( const char* _str, const char* _text );
 XML_C_API bool xml_element_name( XmlElement* _elem, const char* _value );
@@ -113,27 +134,346 @@ XML_C_API XmlAttribute* xml_element_find_attribute( XmlElement* _elem, const cha
 // how many elements have been found, then you can allocate an array of
 // XmlElement pointers and do a second run. if _count is non zero, a check is
 // performed while writing to the XmlElement pointers array.
-XML_C_API unsigned int xml_element_find_elements( XmlElement* _elem, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ );
-XML_C_API unsigned int xml_element_find_attributes( XmlElement* _elem, const char* _name, XmlAttribute* _begin[] /*= 0*/, XmlAttribute* _end[] /*= 0*/ );
+XML_C_API size_t xml_element_find_elements( XmlElement* _elem, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ );
+XML_C_API size_t xml_element_find_attributes( XmlElement* _elem, const char* _name, XmlAttribute* _begin[] /*= 0*/, XmlAttribute* _end[] /*= 0*/ );
 
 typedef void (*XmlForEachFunc)(XmlElement* _elem, void* _param);
 XML_C_API void xml_element_foreach( XmlElement* _elem, XmlForEachFunc _func, void* _param );
 
 XML_C_API XmlElement* xml_element_find_element_by_attribute_value( XmlElement* _elem, const char* _elemName, const char* _attrName, const char* _attrValue );
 
-XML_C_API unsigned int xml_element_find_elements_by_attribute( XmlElement* _elem, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ );
+XML_C_API size_t xml_element_find_elements_by_attribute( XmlElement* _elem, const char* _name, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ );
 
 XML_C_API XmlElement* xml_element_get_root(XmlElement* _e);
 
 // like above, but now we want to know the named attribute's value
 XML_C_API XmlAttribute* xml_element_find_attribute_by_name( XmlElement* self, const char* _elemName, const char* _attrName );
 
-// copy the element content to the buffer. if buffer is 0 it returns the
-// size of the content.
-XML_C_API unsigned int xml_element_get_content( XmlElement* _elem, char* _buffer, unsigned int _size );
+// namespaces. the parser binds the xmlns declarations while it builds the
+// tree: every element and attribute gets its local name and the id of its
+// namespace URI. ids are interned per document, so a (nsId, localName) match
+// is an integer compare and a strcmp. unprefixed attributes and names with
+// an unbound prefix have no namespace (nsId 0).
+#define XML_NAMESPACE_UNKNOWN ((unsigned int)-1)   // matches nothing
+
+// id of _uri in the document of _elem, XML_NAMESPACE_UNKNOWN if the document doesn't use it
+XML_C_API unsigned int xml_namespace_id( XmlElement* _elem, const char* _uri );
+// URI of _nsId in the document of _elem or 0
+XML_C_API const char* xml_namespace_uri( XmlElement* _elem, unsigned int _nsId );
+
+XML_C_API bool xml_element_name_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName );
+XML_C_API bool xml_attribute_name_ns( XmlAttribute* _attr, unsigned int _nsId, const char* _localName );
+
+// namespace-aware versions of the searches above
+XML_C_API XmlElement* xml_element_find_element_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName, XmlElement* _element /*= 0*/ );
+XML_C_API XmlElement* xml_element_find_any_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName );
+XML_C_API XmlAttribute* xml_element_find_attribute_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName, XmlAttribute* _attribute /*= 0*/ );
+XML_C_API size_t xml_element_find_elements_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName, XmlElement* _begin[] /*= 0*/, XmlElement* _end[] /*= 0*/ );
+
+// single pass collection. the matches are appended to a growable result
+// buffer in document order, no counting run. clear the results and reuse them
+// for the next query, the buffer is kept. with an arena the buffer comes from
+// there, otherwise from realloc. items are XmlElement* (or XmlAttribute* for
+// xml_element_collect_attributes).
+typedef struct _XmlResults XmlResults;
+struct _XmlResults
+{
+  void**          items;
+  size_t          count;
+  size_t          capacity;
+  const XmlArena* arena;
+};
+
+XML_C_API void xml_results_init( XmlResults* _results, const XmlArena* _arena /*= 0*/ );
+XML_C_API void xml_results_clear( XmlResults* _results );
+XML_C_API void xml_results_free( XmlResults* _results );
+// the calling thread's scratch results, cleared. they stay valid until the
+// next call on the same thread, xml_results_free releases the buffer.
+XML_C_API XmlResults* xml_results_scratch( void );
+
+// the collect versions of the find functions above. they return false if the
+// buffer couldn't grow, the results then hold the matches up to that point.
+XML_C_API bool xml_element_collect_elements( XmlElement* _elem, const char* _name, XmlResults* _results );
+XML_C_API bool xml_element_collect_elements_by_attribute( XmlElement* _elem, const char* _name, XmlResults* _results );
+XML_C_API bool xml_element_collect_elements_ns( XmlElement* _elem, unsigned int _nsId, const char* _localName, XmlResults* _results );
+XML_C_API bool xml_element_collect_attributes( XmlElement* _elem, const char* _name, XmlResults* _results );
+
+// lazy iteration over the matches of a recursive search, stop whenever you
+// like. the cursor walks the tree through the parent pointers, so it needs no
+// stack and no memory. in attribute mode (xml_cursor_init_attribute) the
+// element is returned once per matching attribute, which is in attribute.
+typedef struct _XmlCursor XmlCursor;
+struct _XmlCursor
+{
+  XmlElement*     root;
+  XmlElement*     element;      // the current match, 0 before the first and after the last
+  XmlAttribute*   attribute;    // the matching attribute in attribute mode
+  const char*     name;
+  const char*     localName;
+  unsigned int    nsId;
+  int             mode;
+};
+
+XML_C_API void xml_cursor_init( XmlCursor* _cursor, XmlElement* _elem, const char* _name /*= 0*/ );
+XML_C_API void xml_cursor_init_ns( XmlCursor* _cursor, XmlElement* _elem, unsigned int _nsId, const char* _localName );
+XML_C_API void xml_cursor_init_attribute( XmlCursor* _cursor, XmlElement* _elem, const char* _name );
+XML_C_API XmlElement* xml_cursor_next( XmlCursor* _cursor );
+
+// copy the text of the whole subtree to the buffer, i.e. "this is <b>bold</b>
+// text" gives "this is bold text". at most _size bytes are written, no zero
+// byte is appended. returns the size of the content, pass a null buffer to
+// only get the size.
+XML_C_API size_t xml_element_get_content( XmlElement* _elem, char* _buffer, size_t _size );
+
+// the same text without copying: a list of spans that point to the text nodes
+// in document order (like struct iovec). at most _count spans are written,
+// the return value is the number of spans in the subtree. *_bytes (if not
+// null) gets the size of the content.
+typedef struct _XmlSpan XmlSpan;
+struct _XmlSpan
+{
+  const char*   data;
+  size_t        size;
+};
+
+XML_C_API size_t xml_element_get_spans( XmlElement* _elem, XmlSpan* _spans, size_t _count, size_t* _bytes );
+
+// structural hashing. the hash of an element covers its name, its attributes
+// (in any order), its text and the hashes of its children (in order). so two
+// subtrees with different hashes differ, two with the same hash are equal
+// with a probability of 1-2^-64.
+
+// (re)compute the hashes of the whole subtree, returns _elem->hash
+XML_C_API XmlHash xml_element_compute_hash( XmlElement* _elem );
+
+// compare two subtrees. if both are hashed this is a single compare,
+// otherwise the trees are compared recursively.
+XML_C_API bool xml_element_equal_fast( XmlElement* _a, XmlElement* _b );
+
+typedef enum
+{
+  XML_DIFF_CHANGED,   // name, attributes or text of the element differ
+  XML_DIFF_ADDED,     // _new was inserted (_old is null)
+  XML_DIFF_REMOVED    // _old was removed (_new is null)
+} XmlDiffKind;
+
+typedef void (*XmlDiffFunc)( XmlDiffKind _kind, XmlElement* _old, XmlElement* _new, void* _param );
+
+// report the differences between two hashed trees. identical subtrees are
+// skipped by their hash, so the cost depends on the changes and not on the
+// document size. returns the number of differences.
+XML_C_API size_t xml_document_diff( XmlElement* _old, XmlElement* _new, XmlDiffFunc _func, void* _param );
+
+// size hints reserve memory behind an element (pointer-aligned, it follows the
+// XmlElement struct). a hint with a prefix ("foo:bar") matches only that name,
+// one without ("bar") also matches the local name of any prefixed element, a
+// hint with element 0 matches every element that no other hint matched.
+//
+// compile the list (terminated by three zeros) into a hash table once and
+// pass it with XmlOptions, so no list is searched per element. the names are
+// copied, the list isn't needed afterwards.
+XML_C_API XmlHintTable* xml_hint_table_create( const XmlSizeofHint* _sizeofHints );
+XML_C_API void xml_hint_table_destroy( XmlHintTable* _table );
+// reserved bytes for an element name
+XML_C_API size_t xml_hint_table_lookup( const XmlHintTable* _table, const char* _name );
 
 // you provide the allocator, so you know how to free it.
 XML_C_API XmlElement* xml_create( const char* _begin, const char* _end, XmlErrorHandler _errorHandler, XmlAllocator _allocator, XmlSizeofHint* _sizeofHints);
 
+typedef struct _XmlOptions XmlOptions;
+
+// parser flags (XmlOptions::flags)
+enum
+{
+  XML_PARSE_SKIP_WHITESPACE = 1<<0,   // drop text nodes that contain nothing but whitespace
+  XML_PARSE_TRIM_TEXT       = 1<<1,   // strip leading and trailing whitespace of text nodes, drop the empty ones
+  XML_PARSE_COALESCE_TEXT   = 1<<2,   // merge adjacent text and CDATA runs into one text node
+  XML_PARSE_HASH            = 1<<3,   // compute XmlElement::hash while building the tree
+  XML_PARSE_SOURCE_RANGES   = 1<<4    // remember where each element is in the source (xml_create_ex only)
+};
+
+// extended parser options. zero-initialize and set what you need, a null
+// pointer gives the xml_create behaviour.
+struct _XmlOptions
+{
+  unsigned int    flags;
+  const XmlArena* arena;    // if set (with an alloc function), it is used instead of the XmlAllocator
+  const XmlHintTable* hints;  // if set, it is used instead of the XmlSizeofHint list
+  // called while the tree is built: open when the start tag and its attributes
+  // are complete, close when the whole subtree is. use them to fill the
+  // reserved bytes (userdata) while the element is still in the cache.
+  XmlForEachFunc  open;
+  XmlForEachFunc  close;
+  void*           param;
+  // elements with more attributes get a hash index for xml_element_find_attribute.
+  // 0 means XML_ATTRIBUTE_HASH_WIDTH, (size_t)-1 turns it off.
+  size_t          attributeHashWidth;
+};
+
+#define XML_ATTRIBUTE_HASH_WIDTH 16
+
+XML_C_API XmlElement* xml_create_ex( const char* _begin, const char* _end, XmlErrorHandler _errorHandler, XmlAllocator _allocator, XmlSizeofHint* _sizeofHints, const XmlOptions* _options );
+
+// release a document that was created with an XmlArena. documents from a
+// plain XmlAllocator are freed the way you allocated them, stream documents
+// with xml_stream_destroy.
+XML_C_API void xml_destroy( XmlElement* _root );
+
+// shared documents. once a document is frozen it is never written again: not
+// by the library (the structural hashes are computed now if they aren't
+// there) and not by you (this includes userdata, fill it with the open/close
+// callbacks while parsing). then any number of threads can query it at the
+// same time. freezing itself is not thread-safe, do it before you share the
+// document.
+//
+// with _cacheSize>0 the document gets a lock-free cache of that many slots
+// for query results, keyed by the query, its arguments and the start element.
+// xml_element_find_element_by_attribute_value uses it. returns false if the
+// cache can't be allocated.
+XML_C_API bool xml_document_freeze( XmlElement* _root, size_t _cacheSize );
+XML_C_API bool xml_document_frozen( XmlElement* _elem );
+
+// reference counting: a new document has one reference. the last release
+// calls xml_destroy, which frees the cache (and the block, if the document
+// came from an XmlArena) and returns true, then a block from a plain
+// XmlAllocator is yours to free. with a cache, always finish with
+// xml_destroy or xml_document_release.
+XML_C_API void xml_document_retain( XmlElement* _root );
+XML_C_API bool xml_document_release( XmlElement* _root );
+
+// source ranges (XML_PARSE_SOURCE_RANGES). every element knows its offset
+// in its parent and its length, every parent indexes its element children
+// and keeps the length changes of their edits in a Fenwick tree. the absolute
+// byte range [*_begin,*_end) is summed up along the path to the root, in
+// O(depth * log(children)).
+XML_C_API bool xml_element_source_range( XmlElement* _elem, size_t* _begin, size_t* _end );
+
+// incremental update after an edit: the bytes [_editBegin,_editEnd) of the
+// previous source were replaced by _newSize bytes, [_begin,_end) is the new
+// source. the innermost element that encloses the edit (its first and last
+// byte excluded) is scanned again and its new subtree is spliced into the
+// tree. returns the new element, or 0 if there is no such element or the new
+// text isn't exactly one element; parse the whole document then. _options
+// (may be null) gives the size hints and callbacks for the new elements.
+//
+// finding the element and moving the elements behind it costs O(depth *
+// log^2(children)), the scan costs the size of the element. with
+// XML_PARSE_HASH the hashes of the ancestors are computed again, which visits
+// all of their children.
+//
+// the new subtree lives in a separate block, the old one stays allocated,
+// both are released with the document by xml_destroy. a frozen document
+// can't be changed.
+XML_C_API XmlElement* xml_reparse_range( XmlElement* _root, const char* _begin, const char* _end, size_t _editBegin, size_t _editEnd, size_t _newSize, XmlErrorHandler _errorHandler, const XmlOptions* _options );
+
+// well-formedness check without building a tree. tags are matched on a
+// fixed-size stack of XML_VALIDATE_DEPTH names, nothing is allocated. the
+// attribute names of a wide tag are checked for duplicates with a hash table
+// on the stack that takes XML_VALIDATE_ATTRIBUTES names, the names behind
+// them are compared one by one.
+#define XML_VALIDATE_DEPTH 256
+#define XML_VALIDATE_ATTRIBUTES 4096
+
+typedef struct _XmlValidationError XmlValidationError;
+struct _XmlValidationError
+{
+  const char*   message;
+  size_t        offset;   // byte offset of the error
+  size_t        line;     // 1-based
+  size_t        column;   // 1-based, in bytes
+};
+
+// returns true if [_begin,_end) is well-formed. otherwise *_error (if not
+// null) tells what and where.
+XML_C_API bool xml_validate( const char* _begin, const char* _end, XmlValidationError* _error );
+
+// line and column (1-based) of _current, i.e. for the XmlErrorHandler arguments
+XML_C_API void xml_error_location( const char* _begin, const char* _current, size_t* _line, size_t* _column );
+
+// streaming tokenizer. the document is pushed in chunks of any size and the
+// handler is called as soon as a token is complete, so the input never has to
+// be in memory as a whole. names and texts are NOT zero-terminated, they point
+// into the chunk (or an internal carry-over buffer) and are only valid during
+// the callback. texts are passed raw, entities are not expanded.
+typedef struct _XmlStream XmlStream;
+typedef struct _XmlStreamHandler XmlStreamHandler;
+
+struct _XmlStreamHandler
+{
+  void (*element_begin)( void* _param, const char* _name, size_t _size );
+  void (*attribute)( void* _param, const char* _name, size_t _nameSize, const char* _value, size_t _valueSize );
+  void (*element_end)( void* _param, const char* _name, size_t _size );
+  void (*text)( void* _param, const char* _text, size_t _size, bool _cdata );
+};
+
+XML_C_API XmlStream* xml_stream_create( const XmlStreamHandler* _handler, void* _param, XmlErrorHandler _errorHandler );
+
+// DOM-building mode: the stream builds an XmlElement tree like xml_create_ex does.
+// the tree lives in a chain of memory blocks owned by the stream, so it stays
+// valid until xml_stream_destroy. _options may be null.
+XML_C_API XmlStream* xml_stream_create_document( XmlErrorHandler _errorHandler, const XmlOptions* _options );
+XML_C_API XmlElement* xml_stream_document( XmlStream* _stream );
+
+// push the next chunk. returns false after an error, the stream is unusable then.
+XML_C_API bool xml_stream_feed( XmlStream* _stream, const char* _data, size_t _size );
+// flush the carry-over buffer and check that all elements are closed.
+XML_C_API bool xml_stream_finish( XmlStream* _stream );
+XML_C_API void xml_stream_destroy( XmlStream* _stream );
+// report an error of the input layer, the stream is unusable afterwards.
+XML_C_API void xml_stream_fail( XmlStream* _stream, const char* _errorMessage );
+
+// columnar export of repeated records, i.e. <row a="1"><x>2</x></row>. every
+// column selects an attribute of the record element or a direct child whose
+// text is the value. rows are appended to malloc'd buffers in the Arrow
+// layout, so they can be handed over without a copy:
+// - validity: one bit per row (LSB first), set if the row has a value
+// - XML_COLUMN_STRING: large_utf8, length+1 64-bit offsets into values
+// - XML_COLUMN_INT64, XML_COLUMN_DOUBLE: length fixed-size values
+// the first match in a record wins, missing fields and numbers that don't
+// parse are null. records are not nested, a record inside a record is a field.
+typedef enum
+{
+  XML_COLUMN_STRING,
+  XML_COLUMN_INT64,
+  XML_COLUMN_DOUBLE
+} XmlColumnType;
+
+typedef struct _XmlColumn XmlColumn;
+struct _XmlColumn
+{
+  // selector, set one of the names and the type, zero the rest
+  const char*     attribute;
+  const char*     element;
+  XmlColumnType   type;
+
+  // Arrow buffers, release them with xml_columns_free
+  size_t          length;       // rows
+  size_t          nullCount;
+  unsigned char*  validity;
+  long long*      offsets;      // strings only
+  void*           values;       // string bytes, long long or double
+  size_t          valuesSize;   // bytes used in values
+
+  // internal
+  size_t          validityCapacity;
+  size_t          offsetsCapacity;
+  size_t          valuesCapacity;
+  char*           scratch;      // text of a number
+  size_t          scratchSize;
+  size_t          scratchCapacity;
+  bool            matched;      // the current row has a value
+  bool            capturing;    // the text of the current child is the value
+};
+
+// append a row for every element named _record in the subtree. returns false
+// if a buffer can't grow, the rows up to then are complete.
+XML_C_API bool xml_element_extract_columns( XmlElement* _elem, const char* _record, XmlColumn* _columns, size_t _count );
+
+// the same during tokenization, without a tree. _record and _columns must stay
+// valid until the stream is destroyed.
+XML_C_API XmlStream* xml_stream_create_columns( const char* _record, XmlColumn* _columns, size_t _count, XmlErrorHandler _errorHandler );
+
+XML_C_API void xml_columns_free( XmlColumn* _columns, size_t _count );
+
 #endif
 // vim:ts=2
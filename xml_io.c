@@ -0,0 +1,977 @@
+/*
+* dbalster's XML DOM parser
+*
+* Copyright (c) Daniel Balster
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Daniel Balster nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY DANIEL BALSTER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL DANIEL BALSTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "xml_io.h"
+
+#include <string.h>		// memcpy
+#include <stdlib.h>		// malloc, free
+#include <errno.h>
+#include <fcntl.h>		// open
+#include <unistd.h>		// read, close
+#include <pthread.h>
+#include <sys/stat.h>	// fstat
+#include <sys/mman.h>	// mmap, madvise
+
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
+#if defined(XML_WITH_URING) && defined(__linux__)
+#  include <linux/io_uring.h>
+#  define XML_IO_URING 1
+#endif
+
+#ifdef XML_WITH_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef XML_WITH_ZSTD
+#  include <zstd.h>
+#endif
+
+// the ring is small on purpose: it only has to hide the jitter between the
+// two stages, a deeper ring just costs memory.
+#define XML_IO_SLOTS       8
+#define XML_IO_SLOT_SIZE   (256*1024)
+#define XML_IO_INPUT_SIZE  (128*1024)
+
+typedef struct _XmlDecoder XmlDecoder;
+typedef struct _XmlPipe XmlPipe;
+
+// pulls compressed bytes from the file descriptor and hands out plain text
+struct _XmlDecoder
+{
+  int                 fd;
+  XmlCodec            codec;
+  char*               input;
+  size_t              inputPos;
+  size_t              inputSize;
+  bool                inputEof;
+  bool                finished;
+  const char*         error;
+#ifdef XML_WITH_ZLIB
+  z_stream            zlib;
+  bool                zlibInit;
+#endif
+#ifdef XML_WITH_ZSTD
+  ZSTD_DStream*       zstd;
+  size_t              zstdPending;	// last ZSTD_decompressStream result, 0 at the end of a frame
+#endif
+};
+
+// single producer (decompressor thread), single consumer (tokenizer) ring
+struct _XmlPipe
+{
+  pthread_mutex_t     lock;
+  pthread_cond_t      filled;
+  pthread_cond_t      drained;
+  XmlDecoder          decoder;
+  char*               slots[XML_IO_SLOTS];
+  size_t              sizes[XML_IO_SLOTS];
+  unsigned int        head;       // next slot to tokenize
+  unsigned int        count;      // number of filled slots
+  bool                eof;
+  bool                cancel;
+};
+
+// refill the input buffer once it has been consumed completely
+static bool xml_decoder_fill( XmlDecoder* _dec )
+{
+  if (_dec->inputPos < _dec->inputSize) return true;
+  if (_dec->inputEof) return false;
+  ssize_t n;
+  do n = read(_dec->fd,_dec->input,XML_IO_INPUT_SIZE);
+  while (n<0 && errno==EINTR);
+  if (n<0)
+  {
+    _dec->error = "read error";
+    return false;
+  }
+  _dec->inputPos = 0;
+  _dec->inputSize = (size_t) n;
+  if (n==0) _dec->inputEof = true;
+  return n>0;
+}
+
+static bool xml_decoder_init( XmlDecoder* _dec, int _fd, XmlCodec _codec )
+{
+  memset(_dec,0,sizeof(XmlDecoder));
+  _dec->fd = _fd;
+  _dec->input = (char*) malloc(XML_IO_INPUT_SIZE);
+  if (0==_dec->input)
+  {
+    _dec->error = "out of memory";
+    return false;
+  }
+  xml_decoder_fill(_dec);
+  if (_dec->error) return false;
+
+  if (XML_CODEC_AUTO == _codec)
+  {
+    const unsigned char* magic = (const unsigned char*) _dec->input;
+    _codec = XML_CODEC_NONE;
+    if (_dec->inputSize>=2 && magic[0]==0x1f && magic[1]==0x8b) _codec = XML_CODEC_GZIP;
+    if (_dec->inputSize>=4 && magic[0]==0x28 && magic[1]==0xb5 && magic[2]==0x2f && magic[3]==0xfd) _codec = XML_CODEC_ZSTD;
+  }
+  _dec->codec = _codec;
+
+  switch (_codec)
+  {
+  case XML_CODEC_GZIP:
+#ifdef XML_WITH_ZLIB
+    if (Z_OK != inflateInit2(&_dec->zlib,15+32))	// +32: accept gzip and zlib headers
+    {
+      _dec->error = "inflateInit2 failed";
+      return false;
+    }
+    _dec->zlibInit = true;
+    return true;
+#else
+    _dec->error = "gzip support not compiled in (XML_WITH_ZLIB)";
+    return false;
+#endif
+  case XML_CODEC_ZSTD:
+#ifdef XML_WITH_ZSTD
+    _dec->zstd = ZSTD_createDStream();
+    if (0==_dec->zstd || ZSTD_isError(ZSTD_initDStream(_dec->zstd)))
+    {
+      _dec->error = "ZSTD_initDStream failed";
+      return false;
+    }
+    return true;
+#else
+    _dec->error = "zstd support not compiled in (XML_WITH_ZSTD)";
+    return false;
+#endif
+  default:
+    return true;
+  }
+}
+
+static void xml_decoder_release( XmlDecoder* _dec )
+{
+#ifdef XML_WITH_ZLIB
+  if (_dec->zlibInit) inflateEnd(&_dec->zlib);
+#endif
+#ifdef XML_WITH_ZSTD
+  if (_dec->zstd) ZSTD_freeDStream(_dec->zstd);
+#endif
+  free(_dec->input);
+}
+
+// decode up to _size bytes. returns 0 at the end of the input or on error.
+static size_t xml_decoder_read( XmlDecoder* _dec, char* _buffer, size_t _size )
+{
+  size_t size = 0;
+  if (_dec->finished || _dec->error) return 0;
+
+  if (XML_CODEC_NONE == _dec->codec)
+  {
+    // hand out what was read for the codec detection, then read directly
+    while (size<_size)
+    {
+      if (_dec->inputPos < _dec->inputSize)
+      {
+        size_t n = _dec->inputSize - _dec->inputPos;
+        if (n > _size-size) n = _size-size;
+        memcpy(_buffer+size,_dec->input+_dec->inputPos,n);
+        _dec->inputPos += n;
+        size += n;
+        continue;
+      }
+      if (_dec->inputEof) break;
+      ssize_t n;
+      do n = read(_dec->fd,_buffer+size,_size-size);
+      while (n<0 && errno==EINTR);
+      if (n<0) { _dec->error = "read error"; return 0; }
+      if (n==0) _dec->inputEof = true;
+      size += (size_t) n;
+    }
+    if (0==size) _dec->finished = true;
+    return size;
+  }
+
+#ifdef XML_WITH_ZLIB
+  if (XML_CODEC_GZIP == _dec->codec)
+  {
+    z_stream* z = &_dec->zlib;
+    z->next_out = (Bytef*) _buffer;
+    z->avail_out = (uInt) _size;
+    while (z->avail_out)
+    {
+      if (!xml_decoder_fill(_dec))
+      {
+        if (!_dec->error) _dec->error = "truncated gzip stream";
+        return 0;
+      }
+      z->next_in = (Bytef*) _dec->input + _dec->inputPos;
+      z->avail_in = (uInt) (_dec->inputSize - _dec->inputPos);
+      int ret = inflate(z,Z_NO_FLUSH);
+      _dec->inputPos = _dec->inputSize - z->avail_in;
+      if (Z_STREAM_END == ret)
+      {
+        // concatenated gzip members are one document (like gunzip does)
+        if (!xml_decoder_fill(_dec))
+        {
+          if (_dec->error) return 0;
+          _dec->finished = true;
+          break;
+        }
+        inflateReset(z);
+      }
+      else if (Z_OK != ret && Z_BUF_ERROR != ret)
+      {
+        _dec->error = z->msg ? z->msg : "inflate failed";
+        return 0;
+      }
+    }
+    return _size - z->avail_out;
+  }
+#endif
+
+#ifdef XML_WITH_ZSTD
+  if (XML_CODEC_ZSTD == _dec->codec)
+  {
+    ZSTD_outBuffer out = { _buffer, _size, 0 };
+    while (out.pos < out.size)
+    {
+      // at the end of the input the decoder may still hold output
+      bool eof = !xml_decoder_fill(_dec);
+      if (eof && _dec->error) return 0;
+      if (eof && 0==_dec->zstdPending)
+      {
+        _dec->finished = true;
+        break;
+      }
+      size_t pos = out.pos;
+      ZSTD_inBuffer in = { _dec->input, _dec->inputSize, _dec->inputPos };
+      size_t ret = ZSTD_decompressStream(_dec->zstd,&out,&in);
+      _dec->inputPos = in.pos;
+      if (ZSTD_isError(ret))
+      {
+        _dec->error = ZSTD_getErrorName(ret);
+        return 0;
+      }
+      _dec->zstdPending = ret;
+      if (eof && out.pos==pos && ret)
+      {
+        _dec->error = "truncated zstd stream";
+        return 0;
+      }
+    }
+    return out.pos;
+  }
+#endif
+
+  return size;
+}
+
+// decompressor thread: fill free slots until the input is exhausted
+static void* xml_pipe_producer( void* _param )
+{
+  XmlPipe* pipe = (XmlPipe*) _param;
+  unsigned int tail = 0;
+  for (;;)
+  {
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == XML_IO_SLOTS && !pipe->cancel) pthread_cond_wait(&pipe->drained,&pipe->lock);
+    bool cancel = pipe->cancel;
+    pthread_mutex_unlock(&pipe->lock);
+    if (cancel) break;
+
+    // the slot is not visible to the consumer until count is incremented
+    size_t size = xml_decoder_read(&pipe->decoder,pipe->slots[tail],XML_IO_SLOT_SIZE);
+
+    pthread_mutex_lock(&pipe->lock);
+    if (size)
+    {
+      pipe->sizes[tail] = size;
+      pipe->count++;
+      tail = (tail+1) % XML_IO_SLOTS;
+    }
+    else
+    {
+      pipe->eof = true;
+    }
+    pthread_cond_signal(&pipe->filled);
+    pthread_mutex_unlock(&pipe->lock);
+    if (0==size) break;
+  }
+  return 0;
+}
+
+XML_C_API bool xml_stream_feed_fd( XmlStream* _stream, int _fd, XmlCodec _codec )
+{
+  XmlPipe pipe;
+  pthread_t thread;
+  bool ok = true;
+  unsigned int i;
+
+  memset(&pipe,0,sizeof(pipe));
+  if (!xml_decoder_init(&pipe.decoder,_fd,_codec))
+  {
+    xml_stream_fail(_stream,pipe.decoder.error);
+    xml_decoder_release(&pipe.decoder);
+    return false;
+  }
+  for (i=0; i<XML_IO_SLOTS; ++i)
+  {
+    pipe.slots[i] = (char*) malloc(XML_IO_SLOT_SIZE);
+    if (0==pipe.slots[i]) ok = false;
+  }
+  pthread_mutex_init(&pipe.lock,0);
+  pthread_cond_init(&pipe.filled,0);
+  pthread_cond_init(&pipe.drained,0);
+
+  if (ok && 0!=pthread_create(&thread,0,xml_pipe_producer,&pipe))
+  {
+    ok = false;
+  }
+  if (!ok)
+  {
+    xml_stream_fail(_stream,"out of resources");
+  }
+  else
+  {
+    for (;;)
+    {
+      pthread_mutex_lock(&pipe.lock);
+      while (pipe.count==0 && !pipe.eof) pthread_cond_wait(&pipe.filled,&pipe.lock);
+      bool done = (pipe.count==0);
+      unsigned int head = pipe.head;
+      pthread_mutex_unlock(&pipe.lock);
+      if (done) break;
+
+      if (!xml_stream_feed(_stream,pipe.slots[head],pipe.sizes[head]))
+      {
+        ok = false;
+        break;
+      }
+
+      pthread_mutex_lock(&pipe.lock);
+      pipe.head = (head+1) % XML_IO_SLOTS;
+      pipe.count--;
+      pthread_cond_signal(&pipe.drained);
+      pthread_mutex_unlock(&pipe.lock);
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    pipe.cancel = true;
+    pthread_cond_signal(&pipe.drained);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(thread,0);
+
+    if (ok && pipe.decoder.error)
+    {
+      xml_stream_fail(_stream,pipe.decoder.error);
+      ok = false;
+    }
+  }
+
+  pthread_cond_destroy(&pipe.drained);
+  pthread_cond_destroy(&pipe.filled);
+  pthread_mutex_destroy(&pipe.lock);
+  for (i=0; i<XML_IO_SLOTS; ++i) free(pipe.slots[i]);
+  xml_decoder_release(&pipe.decoder);
+  return ok;
+}
+
+XML_C_API bool xml_stream_feed_file( XmlStream* _stream, const char* _filename, XmlCodec _codec )
+{
+  int fd = open(_filename,O_RDONLY);
+  if (fd<0)
+  {
+    xml_stream_fail(_stream,"cannot open file");
+    return false;
+  }
+  bool ok = xml_stream_feed_fd(_stream,fd,_codec);
+  close(fd);
+  return ok;
+}
+
+// page-backed arenas. the flags are the context.
+
+#define XML_HUGE_PAGE_SIZE (2*1024*1024)
+#ifndef MPOL_PREFERRED
+#  define MPOL_PREFERRED 1
+#endif
+
+// mapping length: alloc and free must agree on it, even if the huge page
+// mapping failed and normal pages were used instead
+static size_t xml_arena_length( unsigned int _flags, size_t _bytes )
+{
+  size_t page = (_flags & XML_ARENA_HUGEPAGES) ? XML_HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+  return (_bytes + page-1) & ~(page-1);
+}
+
+static void* xml_arena_pages_alloc( void* _context, size_t _bytes )
+{
+  unsigned int flags = (unsigned int)(size_t) _context;
+  size_t length = xml_arena_length(flags,_bytes);
+  void* mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (flags & XML_ARENA_HUGEPAGES) mem = mmap(0,length,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+#endif
+  if (MAP_FAILED==mem)
+  {
+    mem = mmap(0,length,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+    if (MAP_FAILED==mem) return 0;
+#ifdef MADV_HUGEPAGE
+    if (flags & XML_ARENA_HUGEPAGES) madvise(mem,length,MADV_HUGEPAGE);
+#endif
+  }
+#if defined(__linux__) && defined(SYS_mbind) && defined(SYS_getcpu)
+  if (flags & XML_ARENA_NUMA_LOCAL)
+  {
+    // nothing is touched yet, so the policy applies to every page
+    unsigned int cpu = 0, node = 0;
+    unsigned long mask[1024/(8*sizeof(unsigned long))];
+    if (0==syscall(SYS_getcpu,&cpu,&node,0) && node<1024)
+    {
+      memset(mask,0,sizeof(mask));
+      mask[node/(8*sizeof(unsigned long))] |= 1ul << (node%(8*sizeof(unsigned long)));
+      syscall(SYS_mbind,mem,length,MPOL_PREFERRED,mask,(unsigned long)(8*sizeof(mask)),0);
+    }
+  }
+#endif
+  return mem;
+}
+
+static void xml_arena_pages_free( void* _context, void* _memory, size_t _bytes )
+{
+  unsigned int flags = (unsigned int)(size_t) _context;
+  if (_memory) munmap(_memory,xml_arena_length(flags,_bytes));
+}
+
+XML_C_API XmlArena xml_arena_pages( unsigned int _flags )
+{
+  XmlArena arena;
+  arena.context = (void*)(size_t) _flags;
+  arena.alloc = xml_arena_pages_alloc;
+  arena.free = xml_arena_pages_free;
+  arena.zeroed = true;
+  return arena;
+}
+
+// file ingestion
+
+typedef struct _XmlIngestBuffer XmlIngestBuffer;
+typedef struct _XmlIngest XmlIngest;
+
+struct _XmlIngestBuffer
+{
+  XmlIngestBuffer*    next;
+  char*               data;
+  size_t              capacity;
+  size_t              size;
+  size_t              done;       // bytes read so far
+  const char*         filename;
+  int                 fd;
+};
+
+struct _XmlIngest
+{
+  pthread_mutex_t     lock;
+  pthread_cond_t      ready;      // a buffer was queued for the workers
+  pthread_cond_t      recycled;   // a buffer came back from a worker
+  XmlIngestBuffer*    queue;      // completely read, waiting for a worker
+  XmlIngestBuffer*    queueTail;
+  XmlIngestBuffer*    pool;       // free buffers
+  unsigned int        outstanding;  // buffers not in the pool
+  unsigned int        limit;
+  unsigned int        workers;
+  bool                done;
+  XmlIngestFunc       func;
+  XmlIngestErrorFunc  errorFunc;
+  void*               param;
+  bool                ok;
+};
+
+static void xml_ingest_error( XmlIngest* _ingest, int _error, const char* _filename )
+{
+  _ingest->ok = false;
+  if (_ingest->errorFunc) _ingest->errorFunc(_ingest->param,_filename,_error);
+}
+
+// take a buffer from the pool. returns 0 if too many buffers are outstanding
+// and _wait is false.
+static XmlIngestBuffer* xml_ingest_acquire( XmlIngest* _ingest, bool _wait )
+{
+  XmlIngestBuffer* buffer = 0;
+  pthread_mutex_lock(&_ingest->lock);
+  while (_ingest->outstanding >= _ingest->limit && _wait) pthread_cond_wait(&_ingest->recycled,&_ingest->lock);
+  if (_ingest->outstanding < _ingest->limit)
+  {
+    buffer = _ingest->pool;
+    if (buffer) _ingest->pool = buffer->next;
+    else buffer = (XmlIngestBuffer*) calloc(1,sizeof(XmlIngestBuffer));
+    if (buffer) _ingest->outstanding++;
+  }
+  pthread_mutex_unlock(&_ingest->lock);
+  return buffer;
+}
+
+// hand the buffer back. if the callback took over the data, only the header is kept.
+static void xml_ingest_release( XmlIngest* _ingest, XmlIngestBuffer* _buffer, bool _kept )
+{
+  if (_kept)
+  {
+    _buffer->data = 0;
+    _buffer->capacity = 0;
+  }
+  pthread_mutex_lock(&_ingest->lock);
+  _buffer->next = _ingest->pool;
+  _ingest->pool = _buffer;
+  _ingest->outstanding--;
+  pthread_cond_signal(&_ingest->recycled);
+  pthread_mutex_unlock(&_ingest->lock);
+}
+
+// open the file and make the buffer large enough for its content
+static bool xml_ingest_open( XmlIngest* _ingest, XmlIngestBuffer* _buffer, const char* _filename )
+{
+  struct stat st;
+  _buffer->filename = _filename;
+  _buffer->done = 0;
+  _buffer->fd = open(_filename,O_RDONLY);
+  if (_buffer->fd<0)
+  {
+    xml_ingest_error(_ingest,errno,_filename);
+    return false;
+  }
+  if (0!=fstat(_buffer->fd,&st))
+  {
+    int error = errno;
+    close(_buffer->fd);
+    xml_ingest_error(_ingest,error,_filename);
+    return false;
+  }
+  _buffer->size = (size_t) st.st_size;
+  if (_buffer->capacity < _buffer->size+1)
+  {
+    char* data = (char*) realloc(_buffer->data,_buffer->size+1);
+    if (0==data)
+    {
+      close(_buffer->fd);
+      xml_ingest_error(_ingest,ENOMEM,_filename);
+      return false;
+    }
+    _buffer->data = data;
+    _buffer->capacity = _buffer->size+1;
+  }
+  return true;
+}
+
+static void xml_ingest_run( XmlIngest* _ingest, XmlIngestBuffer* _buffer )
+{
+  bool kept = _ingest->func(_ingest->param,_buffer->filename,_buffer->data,_buffer->size);
+  xml_ingest_release(_ingest,_buffer,kept);
+}
+
+// the file is read completely: pass it to a worker or parse it right here
+static void xml_ingest_dispatch( XmlIngest* _ingest, XmlIngestBuffer* _buffer )
+{
+  close(_buffer->fd);
+  _buffer->size = _buffer->done;	// the file may have shrunk
+  _buffer->data[_buffer->size] = 0;
+  if (0==_ingest->workers)
+  {
+    xml_ingest_run(_ingest,_buffer);
+    return;
+  }
+  pthread_mutex_lock(&_ingest->lock);
+  _buffer->next = 0;
+  if (_ingest->queueTail) _ingest->queueTail->next = _buffer;
+  else _ingest->queue = _buffer;
+  _ingest->queueTail = _buffer;
+  pthread_cond_signal(&_ingest->ready);
+  pthread_mutex_unlock(&_ingest->lock);
+}
+
+static void* xml_ingest_worker( void* _param )
+{
+  XmlIngest* ingest = (XmlIngest*) _param;
+  for (;;)
+  {
+    pthread_mutex_lock(&ingest->lock);
+    while (0==ingest->queue && !ingest->done) pthread_cond_wait(&ingest->ready,&ingest->lock);
+    XmlIngestBuffer* buffer = ingest->queue;
+    if (buffer)
+    {
+      ingest->queue = buffer->next;
+      if (0==ingest->queue) ingest->queueTail = 0;
+    }
+    pthread_mutex_unlock(&ingest->lock);
+    if (0==buffer) break;
+    xml_ingest_run(ingest,buffer);
+  }
+  return 0;
+}
+
+// give up on a file that is open already
+static void xml_ingest_fail( XmlIngest* _ingest, XmlIngestBuffer* _buffer, int _error )
+{
+  close(_buffer->fd);
+  xml_ingest_error(_ingest,_error,_buffer->filename);
+  xml_ingest_release(_ingest,_buffer,false);
+}
+
+// read the rest of the file with pread, then dispatch it
+static void xml_ingest_finish( XmlIngest* _ingest, XmlIngestBuffer* _buffer )
+{
+  int error = EIO;	// the file ended early
+  while (_buffer->done < _buffer->size)
+  {
+    ssize_t n = pread(_buffer->fd,_buffer->data+_buffer->done,_buffer->size-_buffer->done,(off_t)_buffer->done);
+    if (n<0 && errno==EINTR) continue;
+    if (n<0) error = errno;
+    if (n<=0) break;
+    _buffer->done += (size_t) n;
+  }
+  if (_buffer->done < _buffer->size) xml_ingest_fail(_ingest,_buffer,error);
+  else xml_ingest_dispatch(_ingest,_buffer);
+}
+
+// blocking fallback, the workers still overlap parsing with reading
+static void xml_ingest_blocking( XmlIngest* _ingest, const char* const* _filenames, size_t _count )
+{
+  size_t i;
+  for (i=0; i<_count; ++i)
+  {
+    XmlIngestBuffer* buffer = xml_ingest_acquire(_ingest,true);
+    if (0==buffer)
+    {
+      xml_ingest_error(_ingest,ENOMEM,_filenames[i]);
+      continue;
+    }
+    if (!xml_ingest_open(_ingest,buffer,_filenames[i]))
+    {
+      xml_ingest_release(_ingest,buffer,false);
+      continue;
+    }
+    xml_ingest_finish(_ingest,buffer);
+  }
+}
+
+#ifdef XML_IO_URING
+
+// minimal io_uring binding on top of the raw syscalls, no liburing needed
+typedef struct _XmlUring XmlUring;
+
+struct _XmlUring
+{
+  int                 fd;
+  unsigned int*       sqHead;
+  unsigned int*       sqTail;
+  unsigned int*       sqMask;
+  unsigned int*       sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned int*       cqHead;
+  unsigned int*       cqTail;
+  unsigned int*       cqMask;
+  struct io_uring_cqe* cqes;
+  void*               sqRing;
+  size_t              sqRingSize;
+  void*               cqRing;
+  size_t              cqRingSize;
+  size_t              sqesSize;
+  unsigned int        pending;    // prepared but not yet submitted
+};
+
+static void xml_uring_release( XmlUring* _ring )
+{
+  if (_ring->sqes) munmap(_ring->sqes,_ring->sqesSize);
+  if (_ring->cqRing && _ring->cqRing!=_ring->sqRing) munmap(_ring->cqRing,_ring->cqRingSize);
+  if (_ring->sqRing) munmap(_ring->sqRing,_ring->sqRingSize);
+  if (_ring->fd>=0) close(_ring->fd);
+}
+
+static bool xml_uring_init( XmlUring* _ring, unsigned int _entries )
+{
+  struct io_uring_params params;
+  memset(_ring,0,sizeof(XmlUring));
+  memset(&params,0,sizeof(params));
+  _ring->fd = (int) syscall(__NR_io_uring_setup,_entries,&params);
+  if (_ring->fd<0) return false;
+
+  _ring->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+  _ring->cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (_ring->cqRingSize > _ring->sqRingSize) _ring->sqRingSize = _ring->cqRingSize;
+    _ring->cqRingSize = _ring->sqRingSize;
+  }
+  _ring->sqRing = mmap(0,_ring->sqRingSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,_ring->fd,IORING_OFF_SQ_RING);
+  if (MAP_FAILED==_ring->sqRing) { _ring->sqRing = 0; xml_uring_release(_ring); return false; }
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    _ring->cqRing = _ring->sqRing;
+  }
+  else
+  {
+    _ring->cqRing = mmap(0,_ring->cqRingSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,_ring->fd,IORING_OFF_CQ_RING);
+    if (MAP_FAILED==_ring->cqRing) { _ring->cqRing = 0; xml_uring_release(_ring); return false; }
+  }
+  _ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+  _ring->sqes = (struct io_uring_sqe*) mmap(0,_ring->sqesSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,_ring->fd,IORING_OFF_SQES);
+  if (MAP_FAILED==(void*)_ring->sqes) { _ring->sqes = 0; xml_uring_release(_ring); return false; }
+
+  char* sq = (char*) _ring->sqRing;
+  char* cq = (char*) _ring->cqRing;
+  _ring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+  _ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+  _ring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+  _ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+  _ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+  _ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+  _ring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+  _ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  return true;
+}
+
+// queue a read of the remaining bytes. a single read is limited to 1 GB,
+// the completion handler queues the rest.
+static void xml_uring_read( XmlUring* _ring, XmlIngestBuffer* _buffer )
+{
+  unsigned int tail = *_ring->sqTail;
+  unsigned int index = tail & *_ring->sqMask;
+  struct io_uring_sqe* sqe = &_ring->sqes[index];
+  size_t size = _buffer->size - _buffer->done;
+  if (size > (1u<<30)) size = 1u<<30;
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = _buffer->fd;
+  sqe->addr = (unsigned long long)(size_t)(_buffer->data + _buffer->done);
+  sqe->len = (unsigned int) size;
+  sqe->off = (unsigned long long) _buffer->done;
+  sqe->user_data = (unsigned long long)(size_t) _buffer;
+  _ring->sqArray[index] = index;
+  __atomic_store_n(_ring->sqTail,tail+1,__ATOMIC_RELEASE);
+  _ring->pending++;
+}
+
+// submit the queued reads and wait for at least one completion
+static bool xml_uring_submit( XmlUring* _ring )
+{
+  for (;;)
+  {
+    long n = syscall(__NR_io_uring_enter,_ring->fd,_ring->pending,1,IORING_ENTER_GETEVENTS,0,0);
+    if (n>=0)
+    {
+      _ring->pending -= (unsigned int) n;
+      return true;
+    }
+    if (errno!=EINTR && errno!=EAGAIN && errno!=EBUSY) return false;
+  }
+}
+
+// io_uring_enter failed for good. the reads the kernel didn't take are taken
+// back, the submitted ones still complete without io_uring_enter and are
+// waited for (their buffers can't be reused before). every buffer is then
+// finished with pread. returns the number of reads that never completed,
+// their buffers are lost.
+static unsigned int xml_ingest_uring_recover( XmlIngest* _ingest, XmlUring* _ring, unsigned int _inflight )
+{
+  unsigned int head = __atomic_load_n(_ring->sqHead,__ATOMIC_ACQUIRE);
+  unsigned int tail = *_ring->sqTail;
+  for (; head!=tail; ++head)
+  {
+    struct io_uring_sqe* sqe = &_ring->sqes[_ring->sqArray[head & *_ring->sqMask]];
+    xml_ingest_finish(_ingest,(XmlIngestBuffer*)(size_t) sqe->user_data);
+    _inflight--;
+  }
+  for (unsigned int wait = 0; _inflight && wait<5000; )
+  {
+    head = *_ring->cqHead;
+    tail = __atomic_load_n(_ring->cqTail,__ATOMIC_ACQUIRE);
+    if (head==tail)
+    {
+      usleep(1000);
+      wait++;
+      continue;
+    }
+    for (; head!=tail; ++head)
+    {
+      struct io_uring_cqe* cqe = &_ring->cqes[head & *_ring->cqMask];
+      XmlIngestBuffer* buffer = (XmlIngestBuffer*)(size_t) cqe->user_data;
+      if (cqe->res>0) buffer->done += (size_t) cqe->res;
+      xml_ingest_finish(_ingest,buffer);
+      _inflight--;
+    }
+    __atomic_store_n(_ring->cqHead,head,__ATOMIC_RELEASE);
+  }
+  return _inflight;
+}
+
+// returns false if io_uring is not usable at all, the caller falls back to blocking reads then
+static bool xml_ingest_uring( XmlIngest* _ingest, const char* const* _filenames, size_t _count, unsigned int _depth )
+{
+  XmlUring ring;
+  size_t next = 0;
+  unsigned int inflight = 0;
+  if (!xml_uring_init(&ring,_depth)) return false;
+
+  while (next<_count || inflight)
+  {
+    while (inflight<_depth && next<_count)
+    {
+      // never block while reads are in flight, their completion may be the
+      // only way to make progress when the callback runs on this thread
+      XmlIngestBuffer* buffer = xml_ingest_acquire(_ingest,0==inflight);
+      if (0==buffer)
+      {
+        if (0==inflight) { xml_ingest_error(_ingest,ENOMEM,_filenames[next]); next++; }
+        break;
+      }
+      if (!xml_ingest_open(_ingest,buffer,_filenames[next++]))
+      {
+        xml_ingest_release(_ingest,buffer,false);
+        continue;
+      }
+      if (0==buffer->size)
+      {
+        xml_ingest_dispatch(_ingest,buffer);
+        continue;
+      }
+      xml_uring_read(&ring,buffer);
+      inflight++;
+    }
+    if (0==inflight) continue;
+
+    if (!xml_uring_submit(&ring))
+    {
+      // the ring broke down: finish what it holds and read the other files
+      // the blocking way, unless buffers are stuck in the kernel
+      if (0==xml_ingest_uring_recover(_ingest,&ring,inflight))
+      {
+        xml_ingest_blocking(_ingest,_filenames+next,_count-next);
+      }
+      else
+      {
+        xml_ingest_error(_ingest,ETIMEDOUT,0);
+        for (; next<_count; ++next) xml_ingest_error(_ingest,ECANCELED,_filenames[next]);
+      }
+      inflight = 0;
+      break;
+    }
+
+    unsigned int head = *ring.cqHead;
+    unsigned int tail = __atomic_load_n(ring.cqTail,__ATOMIC_ACQUIRE);
+    while (head!=tail)
+    {
+      struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+      XmlIngestBuffer* buffer = (XmlIngestBuffer*)(size_t) cqe->user_data;
+      int res = cqe->res;
+      __atomic_store_n(ring.cqHead,++head,__ATOMIC_RELEASE);
+      inflight--;
+
+      if (res<0 && (-EINVAL==res || -EOPNOTSUPP==res))
+      {
+        // kernel without IORING_OP_READ (< 5.6): read this one the old way
+        xml_ingest_finish(_ingest,buffer);
+        continue;
+      }
+      if (res<0 && -EINTR!=res && -EAGAIN!=res)
+      {
+        xml_ingest_fail(_ingest,buffer,-res);
+        continue;
+      }
+      if (res>0) buffer->done += (size_t) res;
+      if (res!=0 && buffer->done < buffer->size)
+      {
+        xml_uring_read(&ring,buffer);	// short read
+        inflight++;
+        continue;
+      }
+      xml_ingest_dispatch(_ingest,buffer);
+    }
+  }
+
+  xml_uring_release(&ring);
+  return true;
+}
+
+#endif
+
+XML_C_API bool xml_ingest_files( const char* const* _filenames, size_t _count, unsigned int _depth, unsigned int _workers, XmlIngestFunc _func, XmlIngestErrorFunc _errorFunc, void* _param )
+{
+  XmlIngest ingest;
+  pthread_t* threads = 0;
+  unsigned int i, started = 0;
+
+  if (0==_func) return false;
+  if (0==_depth) _depth = 1;
+
+  memset(&ingest,0,sizeof(ingest));
+  ingest.func = _func;
+  ingest.errorFunc = _errorFunc;
+  ingest.param = _param;
+  ingest.ok = true;
+  ingest.limit = _depth + 2*_workers;	// reads in flight + queued + being parsed
+  pthread_mutex_init(&ingest.lock,0);
+  pthread_cond_init(&ingest.ready,0);
+  pthread_cond_init(&ingest.recycled,0);
+
+  if (_workers)
+  {
+    threads = (pthread_t*) malloc(_workers*sizeof(pthread_t));
+    for (i=0; threads && i<_workers; ++i)
+    {
+      if (0!=pthread_create(&threads[started],0,xml_ingest_worker,&ingest)) break;
+      started++;
+    }
+  }
+  ingest.workers = started;
+
+  bool async = false;
+#ifdef XML_IO_URING
+  async = xml_ingest_uring(&ingest,_filenames,_count,_depth);
+#endif
+  if (!async) xml_ingest_blocking(&ingest,_filenames,_count);
+
+  pthread_mutex_lock(&ingest.lock);
+  ingest.done = true;
+  pthread_cond_broadcast(&ingest.ready);
+  pthread_mutex_unlock(&ingest.lock);
+  for (i=0; i<started; ++i) pthread_join(threads[i],0);
+  free(threads);
+
+  while (ingest.pool)
+  {
+    XmlIngestBuffer* next = ingest.pool->next;
+    free(ingest.pool->data);
+    free(ingest.pool);
+    ingest.pool = next;
+  }
+  pthread_cond_destroy(&ingest.recycled);
+  pthread_cond_destroy(&ingest.ready);
+  pthread_mutex_destroy(&ingest.lock);
+  return ingest.ok;
+}
+
+// vim:ts=2
@@ -0,0 +1,97 @@
+/*
+* dbalster's XML DOM parser
+*
+* Copyright (c) Daniel Balster
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*     * Redistributions of source code must retain the above copyright
+*       notice, this list of conditions and the following disclaimer.
+*     * Redistributions in binary form must reproduce the above copyright
+*       notice, this list of conditions and the following disclaimer in the
+*       documentation and/or other materials provided with the distribution.
+*     * Neither the name of Daniel Balster nor the
+*       names of its contributors may be used to endorse or promote products
+*       derived from this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY DANIEL BALSTER ``AS IS'' AND ANY
+* EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL DANIEL BALSTER BE LIABLE FOR ANY
+* DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+* (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+* LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+* ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+* (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+* SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef DBALSTER_XML_IO_H
+#define DBALSTER_XML_IO_H
+
+//
+// platform layer (POSIX only): input pipelines for the streaming tokenizer
+// and page-backed memory arenas.
+//
+// compressed documents are decompressed by a separate thread into a ring of
+// buffers, the calling thread tokenizes the buffers as they arrive. so
+// decompression and parsing overlap and the document is never in memory as
+// a whole.
+//
+// many small and medium files are read asynchronously (io_uring on linux
+// with XML_WITH_URING, blocking reads otherwise) with several reads in flight,
+// completed buffers are handed to parser threads.
+//
+// the arenas map their memory directly (optionally with huge pages, on the
+// NUMA node of the parsing thread), so multi-GB trees don't pay for page
+// faults and TLB misses of 4 KB pages.
+//
+// gzip needs XML_WITH_ZLIB, zstd needs XML_WITH_ZSTD at compile time.
+//
+
+#include "xml.h"
+
+typedef enum
+{
+  XML_CODEC_AUTO = 0,   // detect by magic number
+  XML_CODEC_NONE,
+  XML_CODEC_GZIP,
+  XML_CODEC_ZSTD
+} XmlCodec;
+
+// feed the whole file to the stream. xml_stream_finish is NOT called, so
+// multiple files can be concatenated.
+XML_C_API bool xml_stream_feed_fd( XmlStream* _stream, int _fd, XmlCodec _codec );
+XML_C_API bool xml_stream_feed_file( XmlStream* _stream, const char* _filename, XmlCodec _codec );
+
+// called for every completely read file. _data is zero-terminated (_data[_size]==0).
+// ownership: return false and the buffer is recycled for the next read as soon
+// as the callback returns, so no pointer into it may be kept. return true to
+// take the buffer over (zero-copy use, i.e. the result references the text);
+// release it with free() then.
+typedef bool (*XmlIngestFunc)( void* _param, const char* _filename, char* _data, size_t _size );
+
+// called for every file that could not be read, on the calling thread. _error
+// is an errno value. _filename is 0 (ETIMEDOUT) if reads got stuck in the
+// kernel, the files that were not read after that are reported with ECANCELED.
+typedef void (*XmlIngestErrorFunc)( void* _param, const char* _filename, int _error );
+
+// read all files with up to _depth reads in flight. _workers parser threads
+// run the callback, with _workers==0 it runs on the calling thread between
+// the completions. the files are handed out in the order their reads complete.
+// both callbacks get _param. returns false if any file could not be read.
+XML_C_API bool xml_ingest_files( const char* const* _filenames, size_t _count, unsigned int _depth, unsigned int _workers, XmlIngestFunc _func, XmlIngestErrorFunc _errorFunc, void* _param );
+
+// page-backed arena for XmlOptions::arena. anonymous mappings are
+// zero-filled, so the parser doesn't clear the memory again.
+enum
+{
+  XML_ARENA_HUGEPAGES  = 1<<0,  // 2 MB pages: MAP_HUGETLB, transparent huge pages if none are reserved
+  XML_ARENA_NUMA_LOCAL = 1<<1   // place the pages on the NUMA node of the allocating (parsing) thread
+};
+
+XML_C_API XmlArena xml_arena_pages( unsigned int _flags );
+
+#endif
+// vim:ts=2